@@ -1,5 +1,58 @@
 #include "fs.h"
 
+// The block cache keeps at most BCSLOTS blocks mapped, besides the
+// superblock and bitmap, which stay mapped for good.  When it is full,
+// bc_pgfault evicts a block chosen by the CLOCK algorithm using the
+// PTE_A bits.  Evicted blocks are simply unmapped (file data after
+// writing it back if dirty; dirty metadata is not evicted), so
+// pointers into them stay valid: the next access faults the block
+// back in.
+//
+// Clean blocks are mapped read-only.  The first write to one faults,
+// and bc_pgfault adds it to the dirty set and makes it writable, so
+// write-back only visits blocks that were actually changed.
+static uint32_t bc_slots[BCSLOTS];	// Cached block numbers, 0 if free
+static uint32_t bc_nslots;		// Slots in use
+static uint32_t bc_hand;		// CLOCK hand
+
+// Blocks bc_pgfault is reading in right now; not to be evicted
+static uint32_t bc_busy_lo, bc_busy_hi;
+
+// Read-ahead state.  A fault on the block just past the previous
+// read doubles the window, up to the 256 sectors disk_read can do at
+// once; any other fault resets it.
+#define BC_RAMAX	(256 / BLKSECTS)
+static uint32_t bc_ra_next;		// Block after the last read
+static uint32_t bc_ra_win = 1;		// Blocks to read on the next fault
+
+// Dirty set: a bit per disk block, and a list of the blocks whose
+// bit was set.  flush_block only clears the bit, leaving a stale list
+// entry that bc_dirty_compact drops.  Only mapped blocks can be
+// dirty, which bounds the list.
+#define BC_MAXDIRTY	(2 * (BCSLOTS + 2 + DISKSIZE / BLKSIZE / BLKBITSIZE))
+static uint32_t bc_dirtymap[DISKSIZE / BLKSIZE / 32];
+static uint32_t bc_dirty[BC_MAXDIRTY];
+static uint32_t bc_ndirty;
+
+// Most disk writes bc_write_blocks has queued at once
+#define BC_NWRITES	32
+
+// Blocks holding regular file data.  bc_sync writes these before any
+// metadata, so that nothing on disk points at a block before the
+// block itself is there.
+static uint32_t bc_datamap[DISKSIZE / BLKSIZE / 32];
+
+// Requests served since dirty blocks were last written back
+static uint32_t bc_wb_reqs;
+
+uint32_t bc_hits;	// File blocks looked up already in memory
+uint32_t bc_misses;	// File blocks looked up not in memory
+uint32_t bc_reads;	// Disk reads for blocks not in memory
+uint32_t bc_evictions;	// Blocks dropped to make room
+uint32_t bc_readahead;	// Blocks read before they were asked for
+
+static int bc_wb_class(uint32_t blockno);
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -23,6 +76,138 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+static bool
+bc_is_dirty(uint32_t blockno)
+{
+	return (bc_dirtymap[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+// Drop stale and duplicate entries from the dirty list.
+static void
+bc_dirty_compact(void)
+{
+	uint32_t i, n = 0;
+
+	// Clearing each block's bit as it is kept weeds out later
+	// duplicates; the bits are restored afterwards.
+	for (i = 0; i < bc_ndirty; i++)
+		if (bc_is_dirty(bc_dirty[i])) {
+			bc_dirtymap[bc_dirty[i] / 32] &= ~(1 << (bc_dirty[i] % 32));
+			bc_dirty[n++] = bc_dirty[i];
+		}
+	bc_ndirty = n;
+	for (i = 0; i < n; i++)
+		bc_dirtymap[bc_dirty[i] / 32] |= 1 << (bc_dirty[i] % 32);
+}
+
+static void
+bc_mark_dirty(uint32_t blockno)
+{
+	if (bc_is_dirty(blockno))
+		return;
+	bc_dirtymap[blockno / 32] |= 1 << (blockno % 32);
+	if (bc_ndirty == BC_MAXDIRTY)
+		bc_dirty_compact();
+	if (bc_ndirty == BC_MAXDIRTY)
+		panic("bc_mark_dirty: dirty list full");
+	bc_dirty[bc_ndirty++] = blockno;
+}
+
+// Write-protect the cache page at va after it has been written back.
+static void
+bc_clean(void *va)
+{
+	uint32_t blockno = ((uint32_t)va - DISKMAP) / BLKSIZE;
+	int r;
+
+	if ((r = sys_page_map(0, va, 0, va,
+			      uvpt[PGNUM(va)] & PTE_SYSCALL & ~PTE_W)) < 0)
+		panic("bc_clean: sys_page_map: %e", r);
+	bc_dirtymap[blockno / 32] &= ~(1 << (blockno % 32));
+}
+
+// The superblock and bitmap blocks are never evicted.  Until we know
+// where the bitmap ends, treat every block as pinned.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	if (!super)
+		return 1;
+	return blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Return a free slot, evicting a block if the cache is full.
+//
+// Eviction runs in the middle of file operations, when the metadata
+// in the cache may be half updated, so it must not write any back:
+// bc_sync only runs between requests, where every batch it commits is
+// a consistent one.  Dirty metadata therefore stays put until then.
+// Dirty file data may go home at any time, so it is written back and
+// then treated like a clean block.
+static uint32_t *
+bc_alloc_slot(void)
+{
+	uint32_t i;
+	void *va;
+	int r;
+
+	if (bc_nslots < BCSLOTS)
+		return &bc_slots[bc_nslots++];
+
+	// Give every recently used block a second chance.  After one
+	// full turn all PTE_A bits are clear and all file data is clean,
+	// so a second turn finds a block unless every one is dirty
+	// metadata.
+	for (i = 0; i < 2 * BCSLOTS + 1; i++) {
+		uint32_t *slot = &bc_slots[bc_hand];
+		bc_hand = (bc_hand + 1) % BCSLOTS;
+
+		if (*slot >= bc_busy_lo && *slot < bc_busy_hi)
+			continue;
+		va = (char*) (DISKMAP + *slot * BLKSIZE);
+		if (!va_is_mapped(va))
+			return slot;
+		if (va_is_dirty(va)) {
+			if (bc_wb_class(*slot) == 0)
+				flush_block(va);
+			continue;
+		}
+		if (uvpt[PGNUM(va)] & PTE_A) {
+			// Remapping clears PTE_A
+			if ((r = sys_page_map(0, va, 0, va,
+					      uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				panic("bc_alloc_slot: sys_page_map: %e", r);
+			continue;
+		}
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("bc_alloc_slot: sys_page_unmap: %e", r);
+		bc_evictions++;
+		return slot;
+	}
+	panic("bc_alloc_slot: block cache full of dirty metadata");
+}
+
+// Number of blocks to read for a miss on 'blockno': the block itself
+// and the following blocks that are in use but not yet in memory, up
+// to the read-ahead window, which doubles while misses stay
+// sequential.
+static uint32_t
+bc_ra_extent(uint32_t blockno)
+{
+	char *va = (char*) (DISKMAP + blockno * BLKSIZE);
+	uint32_t n;
+
+	if (blockno == bc_ra_next)
+		bc_ra_win = MIN(bc_ra_win * 2, BC_RAMAX);
+	else
+		bc_ra_win = 1;
+	for (n = 1; n < bc_ra_win && bitmap && blockno + n < super->s_nblocks; n++)
+		if (va_is_mapped(va + n * BLKSIZE) || block_is_free(blockno + n))
+			break;
+	bc_ra_next = blockno + n;
+	return n;
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -30,6 +215,7 @@ bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	uint32_t i, n;
 	int r;
 
 	// Check that the fault was within the block cache region
@@ -41,6 +227,16 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
+	// First write to a clean cached block
+	if ((utf->utf_err & FEC_WR) && va_is_mapped(addr)) {
+		addr = ROUNDDOWN(addr, PGSIZE);
+		bc_mark_dirty(blockno);
+		if ((r = sys_page_map(0, addr, 0, addr,
+				      (uvpt[PGNUM(addr)] & PTE_SYSCALL) | PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		return;
+	}
+
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
 	// Hint: first round addr to page boundary. fs/ide.c has code to read
@@ -49,24 +245,103 @@ bc_pgfault(struct UTrapframe *utf)
 	// LAB 5: you code here:
 
     addr = ROUNDDOWN(addr, PGSIZE);
-    sys_page_alloc(0, addr, PTE_W|PTE_U|PTE_P);
+    n = bc_ra_extent(blockno);
 
-    if ((r = ide_read(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
-        panic("ide_read: %e", r);
+    bc_busy_lo = blockno;
+    bc_busy_hi = blockno + n;
+    for (i = 0; i < n; i++) {
+        if (!bc_pinned(blockno + i))
+            *bc_alloc_slot() = blockno + i;
+        if ((r = sys_page_alloc(0, addr + i * BLKSIZE, PTE_W|PTE_U|PTE_P)) < 0)
+            panic("in bc_pgfault, sys_page_alloc: %e", r);
+    }
+    bc_reads++;
+    bc_readahead += n - 1;
+
+    if ((r = disk_read(blockno * BLKSECTS, addr, n * BLKSECTS)) < 0)
+        panic("disk_read: %e", r);
 
-    // Clear the dirty bit for the disk block
-    if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-        panic("in bc_pgfault, sys_page_map: %e", r);
+    // Clear the dirty bit for the disk blocks and write-protect them,
+    // except the faulting block if this was a write to it.
+    for (i = 0; i < n; i++) {
+        if (i == 0 && (utf->utf_err & FEC_WR)) {
+            bc_mark_dirty(blockno);
+            if ((r = sys_page_map(0, addr, 0, addr,
+                                  uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+                panic("in bc_pgfault, sys_page_map: %e", r);
+        } else
+            bc_clean(addr + i * BLKSIZE);
+    }
+    bc_busy_lo = bc_busy_hi = 0;
 
     if (bitmap && block_is_free(blockno))
         panic("reading free block %08x\n", blockno);
 }
 
+// Look up file block 'blockno' for file_get_block, counting a cache
+// hit or miss.  On a miss, bring it and any read-ahead into the cache
+// without holding up the server.  On a server thread with
+// interrupt-driven I/O, the disk reads into the thread's staging pages
+// while other requests run, and the blocks are mapped in read-only
+// once it is done, except those something else has mapped in
+// meanwhile.  Anywhere else the first access faults the block in as
+// usual.  bc_hits and bc_misses count only these lookups, so they
+// give the hit rate for file data; bc_reads counts every read.
+void
+bc_fetch(uint32_t blockno)
+{
+	struct BlkReq req;
+	char *va = (char*) (DISKMAP + blockno * BLKSIZE), *stage;
+	uint32_t i, n, busy_lo, busy_hi;
+	int id, r;
+
+	if (va_is_mapped(va)) {
+		bc_hits++;
+		return;
+	}
+	bc_misses++;
+	if ((id = thread_id()) < 0 || !disk_async())
+		return;
+
+	n = bc_ra_extent(blockno);
+	stage = (char*) (THREADSTAGE + id * BC_RAMAX * BLKSIZE);
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_alloc(0, stage + i * BLKSIZE, PTE_W|PTE_U|PTE_P)) < 0)
+			panic("bc_fetch: sys_page_alloc: %e", r);
+	req.br_secno = blockno * BLKSECTS;
+	req.br_buf = stage;
+	req.br_nsecs = n * BLKSECTS;
+	req.br_write = 0;
+	disk_submit(&req);
+	if ((r = thread_wait_io(&req)) < 0)
+		panic("bc_fetch: disk read: %e", r);
+
+	busy_lo = bc_busy_lo;
+	busy_hi = bc_busy_hi;
+	bc_busy_lo = blockno;
+	bc_busy_hi = blockno + n;
+	for (i = 0; i < n; i++) {
+		if (!va_is_mapped(va + i * BLKSIZE)) {
+			if (!bc_pinned(blockno + i))
+				*bc_alloc_slot() = blockno + i;
+			if ((r = sys_page_map(0, stage + i * BLKSIZE, 0,
+					      va + i * BLKSIZE, PTE_U|PTE_P)) < 0)
+				panic("bc_fetch: sys_page_map: %e", r);
+		}
+		if ((r = sys_page_unmap(0, stage + i * BLKSIZE)) < 0)
+			panic("bc_fetch: sys_page_unmap: %e", r);
+	}
+	bc_busy_lo = busy_lo;
+	bc_busy_hi = busy_hi;
+	bc_reads++;
+	bc_readahead += n - 1;
+}
+
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
 // nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
+// Hint: Use va_is_mapped, va_is_dirty, and disk_write.
 // Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
 // Hint: Don't forget to round addr down.
 void
@@ -79,14 +354,190 @@ flush_block(void *addr)
 
     // LAB 5: Your code here.
     addr = ROUNDDOWN(addr, PGSIZE);
-    if (!va_is_mapped(addr) || !va_is_dirty(addr)) {        
+    if (!va_is_mapped(addr)) {
+        bc_dirtymap[blockno / 32] &= ~(1 << (blockno % 32));
+        return;
+    }
+    if (!va_is_dirty(addr)) {        
         return;
     }
-    if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0) {      
-        panic("in flush_block, ide_write(): %e", r);
+    if ((r = disk_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0) {      
+        panic("in flush_block, disk_write(): %e", r);
     }
-    if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)  
-        panic("in bc_pgfault, sys_page_map: %e", r);
+    bc_clean(addr);
+}
+
+// Note that 'blockno' holds regular file data.
+void
+bc_mark_data(uint32_t blockno)
+{
+	bc_datamap[blockno / 32] |= 1 << (blockno % 32);
+}
+
+// Note that 'blockno' does not hold file data.  Called whenever a
+// block is allocated, so a block that used to hold data is written
+// back as metadata if that is what it holds now; file_get_block marks
+// it again if it is data.
+void
+bc_mark_meta(uint32_t blockno)
+{
+	bc_datamap[blockno / 32] &= ~(1 << (blockno % 32));
+}
+
+// The order bc_sync writes a block in: file data, then the bitmap,
+// then other metadata (directories, indirect and index blocks), and
+// the superblock last.  That puts newly allocated blocks in the
+// bitmap before anything points at them; freed blocks only reach the
+// bitmap a write-back after the metadata that dropped them (see
+// free_block), so the order is safe both ways even without a journal.
+static int
+bc_wb_class(uint32_t blockno)
+{
+	if (blockno == 1)
+		return 3;
+	if (bc_pinned(blockno))
+		return 1;
+	if (bc_datamap[blockno / 32] & (1 << (blockno % 32)))
+		return 0;
+	return 2;
+}
+
+// Write the n blocks listed in blocknos, which are mapped and dirty,
+// to their home locations with one disk write per run of consecutive
+// blocks, and write-protect them again.  The runs are all queued
+// before waiting for any, so the disk can take them back to back.
+static void
+bc_write_blocks(const uint32_t *blocknos, uint32_t n)
+{
+	static struct BlkReq reqs[BC_NWRITES];
+	uint32_t i, j, k, b, nreqs = 0;
+	int r;
+
+	for (i = 0; i < n; i += k) {
+		b = blocknos[i];
+		for (k = 1; i + k < n && k < 256 / BLKSECTS
+			     && blocknos[i + k] == b + k; k++)
+			/* do nothing */;
+		reqs[nreqs].br_secno = b * BLKSECTS;
+		reqs[nreqs].br_buf = diskaddr(b);
+		reqs[nreqs].br_nsecs = k * BLKSECTS;
+		reqs[nreqs].br_write = 1;
+		disk_submit(&reqs[nreqs++]);
+
+		// Keep up to BC_NWRITES runs queued at the disk at once
+		if (nreqs < BC_NWRITES && i + k < n)
+			continue;
+		for (j = 0; j < nreqs; j++) {
+			if ((r = disk_wait(&reqs[j])) < 0)
+				panic("in bc_sync, disk_write(): %e", r);
+			for (b = 0; b < reqs[j].br_nsecs / BLKSECTS; b++)
+				bc_clean((char *) reqs[j].br_buf + b * BLKSIZE);
+		}
+		nreqs = 0;
+	}
+}
+
+// Write back every dirty block in the cache, class by class in the
+// order bc_wb_class gives, each class in block order.  File data goes
+// straight home.  If the disk has a journal, all the metadata is
+// committed to it first as one transaction, so a crash cannot leave a
+// half-written batch of metadata behind; bc_writeback keeps batches
+// small enough to fit.
+void
+bc_sync(void)
+{
+	uint32_t i, j, n, b;
+	int class;
+	char *va;
+
+	bc_wb_reqs = 0;
+	bc_dirty_compact();
+
+	// Insertion sort; the list is short
+	for (i = 1; i < bc_ndirty; i++) {
+		b = bc_dirty[i];
+		for (j = i; j > 0 && bc_dirty[j - 1] > b; j--)
+			bc_dirty[j] = bc_dirty[j - 1];
+		bc_dirty[j] = b;
+	}
+
+	// Pull the blocks that really need writing to the front of
+	// bc_dirty, grouped by class, and forget the rest.
+	n = 0;
+	for (class = 0; class < 4; class++)
+		for (i = n; i < bc_ndirty; i++) {
+			b = bc_dirty[i];
+			if (bc_wb_class(b) != class)
+				continue;
+			va = (char*) (DISKMAP + b * BLKSIZE);
+			if (!va_is_mapped(va))
+				flush_block(va);
+			else if (!va_is_dirty(va))
+				bc_clean(va);
+			else {
+				// Keep the class sorted: shift, don't swap
+				for (j = i; j > n; j--)
+					bc_dirty[j] = bc_dirty[j - 1];
+				bc_dirty[n++] = b;
+			}
+		}
+
+	// File data, then metadata
+	for (i = 0; i < n && bc_wb_class(bc_dirty[i]) == 0; i++)
+		/* do nothing */;
+	bc_write_blocks(bc_dirty, i);
+	if (i == n || journal_capacity() == 0)
+		bc_write_blocks(bc_dirty + i, n - i);
+	else {
+		if (n - i > journal_capacity())
+			panic("bc_sync: %d dirty metadata blocks, journal holds %d",
+			      n - i, journal_capacity());
+		journal_commit(bc_dirty + i, n - i);
+		bc_write_blocks(bc_dirty + i, n - i);
+		journal_clear();
+	}
+	bc_ndirty = 0;
+
+	// Blocks freed by what was just committed may now be reused
+	bitmap_release();
+}
+
+// Number of dirty metadata blocks, counting any block listed twice
+// in bc_dirty twice.
+static uint32_t
+bc_dirty_meta(void)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < bc_ndirty; i++)
+		if (bc_is_dirty(bc_dirty[i]) && bc_wb_class(bc_dirty[i]) != 0)
+			n++;
+	return n;
+}
+
+// Called after each file system request.  Dirty blocks are written
+// back once BC_WB_DIRTY of them pile up, once BC_WB_REQS requests
+// have gone by since the last write-back, or once dirty metadata fills
+// half the journal, which leaves the other half for the next request;
+// FSREQ_FLUSH and FSREQ_SYNC write back immediately.
+void
+bc_writeback(void)
+{
+	if (bc_ndirty == 0)
+		return;
+	if (bc_ndirty >= BC_WB_DIRTY || ++bc_wb_reqs >= BC_WB_REQS
+	    || (journal_capacity() > 0
+		&& bc_dirty_meta() >= journal_capacity() / 2))
+		bc_sync();
+}
+
+void
+bc_report(void)
+{
+	cprintf("block cache: %d/%d blocks, file blocks %u hits %u misses, "
+		"%u reads, %u read ahead, %u evictions, %u dirty\n",
+		bc_nslots, BCSLOTS, bc_hits, bc_misses, bc_reads,
+		bc_readahead, bc_evictions, bc_ndirty);
 }
 
 // Test that the block cache works, by smashing the superblock and
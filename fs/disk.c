@@ -0,0 +1,240 @@
+// The disk the file system lives on: a virtio block device if the
+// machine has one (QEMU's "-drive file=fs.img,if=virtio"); otherwise
+// a volume striped over IDE disks 0 and 1 if disk 1 has a StripeLabel;
+// otherwise IDE disk 1, or disk 0 if there is no disk 1.  The block
+// cache and the journal go through here and do not care which.
+
+#include "fs.h"
+
+static bool disk_virtio;
+static int disk_dev;			// IDE disk, if not striped
+
+// Striped volume: stripe unit (0 if not striped) and member size,
+// in sectors
+static uint32_t disk_stripe;
+static uint32_t disk_member_nsect;
+
+// Pieces of striped requests, one per stripe unit touched.  A piece is
+// in use iff br_parent is set.
+#define DISK_NPIECES	128
+static struct BlkReq disk_pieces[DISK_NPIECES];
+static uint32_t disk_reap_next;
+
+// Read sector 'secno' of IDE disk 'dev' into l.
+static int
+disk_read_label(int dev, uint32_t secno, struct StripeLabel *l)
+{
+	static char buf[SECTSIZE] __attribute__((aligned(SECTSIZE)));
+	struct BlkReq req;
+	int r;
+
+	req.br_dev = dev;
+	req.br_secno = secno;
+	req.br_buf = buf;
+	req.br_nsecs = 1;
+	req.br_write = 0;
+	ide_submit(&req);
+	if ((r = ide_wait(&req)) < 0)
+		return r;
+	memmove(l, buf, sizeof(*l));
+	return 0;
+}
+
+// Set up a striped volume if IDE disk 1 is the second member of one.
+// Returns 0 if so, < 0 if not.
+static int
+disk_stripe_init(void)
+{
+	struct StripeLabel l1, l0;
+	int r;
+
+	if ((r = disk_read_label(1, 0, &l1)) < 0)
+		panic("reading disk 1: %e", r);
+	if (l1.sl_magic != STRIPE_MAGIC)
+		return -E_NOT_FOUND;
+	if (l1.sl_member != 1 || l1.sl_start[1] != 0 || l1.sl_stripe == 0
+	    || l1.sl_nsect % l1.sl_stripe != 0)
+		panic("disk 1: bad stripe label");
+	if ((r = disk_read_label(0, l1.sl_start[0], &l0)) < 0)
+		panic("reading disk 0: %e", r);
+	if (l0.sl_magic != STRIPE_MAGIC || l0.sl_member != 0
+	    || l0.sl_stripe != l1.sl_stripe || l0.sl_nsect != l1.sl_nsect
+	    || l0.sl_start[0] != l1.sl_start[0])
+		panic("disk 0 at sector %d: missing or mismatched stripe label",
+		      l1.sl_start[0]);
+
+	// Each member's share starts after its label block
+	ide_set_disk(0);
+	ide_set_partition(l1.sl_start[0] + BLKSECTS, l1.sl_nsect);
+	ide_set_disk(1);
+	ide_set_partition(l1.sl_start[1] + BLKSECTS, l1.sl_nsect);
+	disk_stripe = l1.sl_stripe;
+	disk_member_nsect = l1.sl_nsect;
+	cprintf("disk: striped over IDE disks 0 and 1, %d-sector stripes\n",
+		disk_stripe);
+	return 0;
+}
+
+void
+disk_init(void)
+{
+	if (virtio_init() == 0) {
+		disk_virtio = 1;
+		return;
+	}
+
+	// Find a JOS disk.  Use the second IDE disk (number 1) if available
+	ide_init();
+	if (ide_probe_disk1()) {
+		if (disk_stripe_init() == 0)
+			return;
+		disk_dev = 1;
+	} else
+		disk_dev = 0;
+}
+
+// Wait for piece p to finish and account for it in its parent.
+static void
+disk_reap(struct BlkReq *p)
+{
+	struct BlkReq *req = p->br_parent;
+	int r;
+
+	if ((r = ide_wait(p)) < 0)
+		req->br_result = r;
+	if (--req->br_npieces == 0)
+		req->br_done = 1;
+	p->br_parent = NULL;
+}
+
+static struct BlkReq *
+disk_piece_alloc(void)
+{
+	int i;
+
+	for (i = 0; i < DISK_NPIECES; i++)
+		if (!disk_pieces[i].br_parent)
+			return &disk_pieces[i];
+	// All busy: wait for one
+	i = disk_reap_next++ % DISK_NPIECES;
+	disk_reap(&disk_pieces[i]);
+	return &disk_pieces[i];
+}
+
+// Split req at stripe boundaries and queue the pieces on the member
+// disks, alternating between them every disk_stripe sectors.
+static void
+disk_stripe_submit(struct BlkReq *req)
+{
+	uint32_t secno = req->br_secno, left = req->br_nsecs, stripe, n;
+	char *buf = req->br_buf;
+	struct BlkReq *p;
+
+	req->br_done = 0;
+	req->br_result = 0;
+	if (secno > STRIPE_NMEMBERS * disk_member_nsect
+	    || left > STRIPE_NMEMBERS * disk_member_nsect - secno) {
+		req->br_result = -E_INVAL;
+		req->br_done = 1;
+		return;
+	}
+
+	// Hold an extra count so reaping a piece while we are still
+	// splitting cannot complete req early
+	req->br_npieces = 1;
+	for (; left > 0; secno += n, left -= n, buf += n * SECTSIZE) {
+		p = disk_piece_alloc();
+		stripe = secno / disk_stripe;
+		n = MIN(disk_stripe - secno % disk_stripe, left);
+		p->br_dev = stripe % STRIPE_NMEMBERS;
+		p->br_secno = (stripe / STRIPE_NMEMBERS) * disk_stripe
+			+ secno % disk_stripe;
+		p->br_buf = buf;
+		p->br_nsecs = n;
+		p->br_write = req->br_write;
+		p->br_parent = req;
+		req->br_npieces++;
+		ide_submit(p);
+	}
+	if (--req->br_npieces == 0)
+		req->br_done = 1;
+}
+
+// Queue a transfer.  Its buffer must stay put until disk_wait returns.
+void
+disk_submit(struct BlkReq *req)
+{
+	if (disk_virtio)
+		virtio_submit(req);
+	else if (disk_stripe)
+		disk_stripe_submit(req);
+	else {
+		req->br_dev = disk_dev;
+		ide_submit(req);
+	}
+}
+
+// Wait for a submitted request to complete and return its result:
+// 0 on success, < 0 on error.
+int
+disk_wait(struct BlkReq *req)
+{
+	int i;
+
+	if (disk_virtio)
+		return virtio_wait(req);
+	if (!disk_stripe)
+		return ide_wait(req);
+
+	for (i = 0; i < DISK_NPIECES && !req->br_done; i++)
+		if (disk_pieces[i].br_parent == req)
+			disk_reap(&disk_pieces[i]);
+	return req->br_result;
+}
+
+// Do requests complete by interrupt, so that a server thread can
+// wait for one while others run?  Striped requests complete only in
+// disk_wait, so they do not.
+bool
+disk_async(void)
+{
+	if (disk_virtio)
+		return virtio_async();
+	return !disk_stripe && ide_async();
+}
+
+// Handle interrupt 'irq', delivered to the serve loop as a message.
+void
+disk_intr(int irq)
+{
+	if (disk_virtio)
+		virtio_intr();
+	else if (irq == IRQ_IDE)
+		ide_intr();
+}
+
+int
+disk_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	struct BlkReq req;
+
+	req.br_secno = secno;
+	req.br_buf = dst;
+	req.br_nsecs = nsecs;
+	req.br_write = 0;
+	disk_submit(&req);
+	return disk_wait(&req);
+}
+
+int
+disk_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	struct BlkReq req;
+
+	req.br_secno = secno;
+	req.br_buf = (void *) src;
+	req.br_nsecs = nsecs;
+	req.br_write = 1;
+	disk_submit(&req);
+	return disk_wait(&req);
+}
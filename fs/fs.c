@@ -24,6 +24,50 @@ check_super(void)
 // Free block bitmap
 // --------------------------------------------------------------
 
+// Number of free blocks described by each bitmap block, so that
+// alloc_block can skip full stretches of the disk.
+static uint32_t bitmap_nfree[DISKSIZE / BLKSIZE / BLKBITSIZE];
+
+// Next-fit cursor: alloc_block starts searching at this block.
+static uint32_t alloc_next;
+
+// Blocks freed since the last write-back.  They stay in use in the
+// bitmap until bc_sync has written the metadata that stopped using
+// them (committed it, with a journal), and then bitmap_release frees
+// them.  A block handed out sooner could have its new contents
+// written home while the metadata on disk still points at it; and
+// without a journal, writing the bitmap first would leave a block
+// free on disk that a file still uses, to be allocated twice after a
+// crash.
+static uint32_t bitmap_freeing[DISKSIZE / BLKSIZE / 32];
+static uint32_t bitmap_nfreeing;
+
+static int
+popcount(uint32_t x)
+{
+	int n;
+
+	for (n = 0; x; n++)
+		x &= x - 1;
+	return n;
+}
+
+// Count the free blocks under each bitmap block.  The bits past
+// s_nblocks in the last word are not blocks and do not count.
+static void
+bitmap_count(void)
+{
+	uint32_t w, bits, nwords = (super->s_nblocks + 31) / 32;
+
+	memset(bitmap_nfree, 0, sizeof(bitmap_nfree));
+	for (w = 0; w < nwords; w++) {
+		bits = bitmap[w];
+		if (w == nwords - 1 && super->s_nblocks % 32)
+			bits &= (1 << (super->s_nblocks % 32)) - 1;
+		bitmap_nfree[w / (BLKBITSIZE / 32)] += popcount(bits);
+	}
+}
+
 // Check to see if the block bitmap indicates that block 'blockno' is free.
 // Return 1 if the block is free, 0 if not.
 bool
@@ -36,19 +80,55 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
-// Mark a block free in the bitmap
+// Mark a block free in the bitmap, at the next write-back (see
+// bitmap_freeing).
 void
 free_block(uint32_t blockno)
 {
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
-	bitmap[blockno/32] |= 1<<(blockno%32);
+	if (bitmap[blockno/32] & (1<<(blockno%32)))
+		return;
+	if (bitmap_freeing[blockno / 32] & (1 << (blockno % 32)))
+		return;
+	bitmap_freeing[blockno / 32] |= 1 << (blockno % 32);
+	bitmap_nfreeing++;
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Free the blocks free_block held back.  Called by bc_sync once the
+// metadata that let go of them is on disk; the bitmap blocks go out
+// with the next write-back.
+void
+bitmap_release(void)
+{
+	uint32_t w, nwords;
+
+	if (bitmap_nfreeing == 0)
+		return;
+	nwords = (super->s_nblocks + 31) / 32;
+	for (w = 0; w < nwords; w++) {
+		if (bitmap_freeing[w] == 0)
+			continue;
+		bitmap[w] |= bitmap_freeing[w];
+		bitmap_nfree[w / (BLKBITSIZE / 32)] += popcount(bitmap_freeing[w]);
+		bitmap_freeing[w] = 0;
+	}
+	bitmap_nfreeing = 0;
+}
+
+// Mark free block 'blockno' in use.  The bitmap block is written
+// back with the next bc_sync.
+static void
+bitmap_take(uint32_t blockno)
+{
+	bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+	bitmap_nfree[blockno / BLKBITSIZE]--;
+	alloc_next = (blockno + 1) % super->s_nblocks;
+	bc_mark_meta(blockno);
+}
+
+// Search the bitmap for a free block and allocate it.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
@@ -62,18 +142,47 @@ alloc_block(void)
 	// super->s_nblocks blocks in the disk altogether.
 
 	// LAB 5: Your code here.
-    uint32_t bmpblock_start = 2;
-    for (uint32_t blockno = 0; blockno < super->s_nblocks; blockno++) {
-        if (block_is_free(blockno)) {                   
-            bitmap[blockno / 32] &= ~(1 << (blockno % 32));    
-            flush_block(diskaddr(bmpblock_start + (blockno / 32) / NINDIRECT)); 
-            return blockno;
+    // Starting at the cursor, look for a non-zero bitmap word in each
+    // bitmap block that has free blocks, wrapping around once.  The
+    // block the search started in is visited again at the end to
+    // cover the words before the cursor.
+    uint32_t nbitblocks = (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+    uint32_t nwords = (super->s_nblocks + 31) / 32;
+    uint32_t bm = alloc_next / BLKBITSIZE, w = alloc_next / 32;
+    uint32_t k, wend, blockno;
+
+    for (k = 0; k <= nbitblocks; k++) {
+        if (bitmap_nfree[bm] != 0) {
+            wend = MIN((bm + 1) * (BLKBITSIZE / 32), nwords);
+            for (; w < wend; w++) {
+                if (bitmap[w] == 0)
+                    continue;
+                blockno = w * 32 + __builtin_ctz(bitmap[w]);
+                if (blockno >= super->s_nblocks)
+                    break;
+                bitmap_take(blockno);
+                return blockno;
+            }
         }
+        bm = (bm + 1) % nbitblocks;
+        w = bm * (BLKBITSIZE / 32);
     }
-    
+
     return -E_NO_DISK;
 }
 
+// Allocate block 'goal' if it is free, or else any free block.
+// Returns the block number or -E_NO_DISK.
+int
+alloc_block_near(uint32_t goal)
+{
+	if (goal != 0 && block_is_free(goal)) {
+		bitmap_take(goal);
+		return goal;
+	}
+	return alloc_block();
+}
+
 // Validate the file system bitmap.
 //
 // Check that all reserved blocks -- 0, 1, and the bitmap blocks themselves --
@@ -106,20 +215,18 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
 
-	// Find a JOS disk.  Use the second IDE disk (number 1) if available
-	if (ide_probe_disk1())
-		ide_set_disk(1);
-	else
-		ide_set_disk(0);
+	disk_init();
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+	journal_init();
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
+	bitmap_count();
 	
 }
 
@@ -128,7 +235,7 @@ fs_init(void)
 // The slot will be one of the f->f_direct[] entries,
 // or an entry in the indirect block.
 // When 'alloc' is set, this function will allocate an indirect block
-// if necessary.
+// if necessary.  Only for files without FILE_EXTENTS.
 //
 // Returns:
 //	0 on success (but note that *ppdiskbno might equal 0).
@@ -161,14 +268,290 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
             if ((bn = alloc_block()) < 0)
                 return bn;
             f->f_indirect = bn;
-            flush_block(diskaddr(bn));
             indirects = diskaddr(bn);
+            memset(indirects, 0, BLKSIZE);
             *ppdiskbno = &(indirects[filebno - NDIRECT]);
         }
     }
     return 0;
 }
 
+// Return the i'th extent of extent-mapped file 'f'.
+static struct Extent *
+file_extent(struct File *f, uint32_t i)
+{
+	if (i < NEXTENT)
+		return &f->f_extents[i];
+	return (struct Extent *) diskaddr(f->f_extindex) + (i - NEXTENT);
+}
+
+// Binary-search the extents of 'f' for the last one starting at or
+// before file block 'filebno'.  Returns its index, or -1 if there is
+// none.
+static int
+extent_search(struct File *f, uint32_t filebno)
+{
+	int lo = 0, hi = (int) f->f_nextents - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (file_extent(f, mid)->e_fileblk <= filebno)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+// Open a hole for a new extent at index i.
+static void
+extent_insert(struct File *f, uint32_t i)
+{
+	uint32_t j;
+
+	for (j = f->f_nextents; j > i; j--)
+		*file_extent(f, j) = *file_extent(f, j - 1);
+	f->f_nextents++;
+}
+
+// Remove the extent at index i.
+static void
+extent_remove(struct File *f, uint32_t i)
+{
+	uint32_t j;
+
+	for (j = i; j + 1 < f->f_nextents; j++)
+		*file_extent(f, j) = *file_extent(f, j + 1);
+	f->f_nextents--;
+}
+
+// Map the unmapped file block 'filebno' of 'f' to disk block 'diskbno'.
+// The block joins a neighbouring extent when it is contiguous with it
+// on disk, so files written in order need only one extent.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if the extent map is full, or an index block is
+//		needed and the disk is full.
+static int
+extent_add(struct File *f, uint32_t filebno, uint32_t diskbno)
+{
+	int i = extent_search(f, filebno), bn;
+	struct Extent *e, *next = NULL;
+
+	if (i + 1 < (int) f->f_nextents)
+		next = file_extent(f, i + 1);
+
+	// Grow the extent ending just before filebno, and merge it with
+	// the next one if they now meet.
+	if (i >= 0) {
+		e = file_extent(f, i);
+		if (e->e_fileblk + e->e_len == filebno
+		    && e->e_diskblk + e->e_len == diskbno) {
+			e->e_len++;
+			if (next && next->e_fileblk == filebno + 1
+			    && next->e_diskblk == diskbno + 1) {
+				e->e_len += next->e_len;
+				extent_remove(f, i + 1);
+			}
+			return 0;
+		}
+	}
+
+	// Grow the extent starting just after it
+	if (next && next->e_fileblk == filebno + 1
+	    && next->e_diskblk == diskbno + 1) {
+		next->e_fileblk--;
+		next->e_diskblk--;
+		next->e_len++;
+		return 0;
+	}
+
+	if (f->f_nextents == MAXEXTENT)
+		return -E_NO_DISK;
+	if (f->f_nextents == NEXTENT && !f->f_extindex) {
+		if ((bn = alloc_block()) < 0)
+			return bn;
+		f->f_extindex = bn;
+	}
+	extent_insert(f, i + 1);
+	e = file_extent(f, i + 1);
+	e->e_fileblk = filebno;
+	e->e_diskblk = diskbno;
+	e->e_len = 1;
+	return 0;
+}
+
+// Free the blocks of extent-mapped 'f' from file block 'nblocks' on,
+// including any preallocated past the end of the file, and the index
+// block once the extents fit in 'f' again.
+static void
+extent_truncate(struct File *f, uint32_t nblocks)
+{
+	struct Extent *e;
+	uint32_t keep;
+
+	while (f->f_nextents > 0) {
+		e = file_extent(f, f->f_nextents - 1);
+		if (e->e_fileblk + e->e_len <= nblocks)
+			break;
+		keep = e->e_fileblk < nblocks ? nblocks - e->e_fileblk : 0;
+		while (e->e_len > keep)
+			free_block(e->e_diskblk + --e->e_len);
+		if (e->e_len == 0)
+			f->f_nextents--;
+	}
+
+	if (f->f_nextents <= NEXTENT && f->f_extindex) {
+		free_block(f->f_extindex);
+		f->f_extindex = 0;
+	}
+}
+
+// Set *pdiskbno to the disk block holding the filebno'th block of
+// 'f', or to 0 if that block is not allocated.
+//
+// Returns 0 on success, -E_INVAL if filebno is out of range.
+static int
+file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno)
+{
+	int r, i;
+	uint32_t *ptr;
+	struct Extent *e;
+
+	*pdiskbno = 0;
+	if (f->f_flags & FILE_EXTENTS) {
+		if (filebno >= MAXEXTFILESIZE / BLKSIZE)
+			return -E_INVAL;
+		if ((i = extent_search(f, filebno)) >= 0) {
+			e = file_extent(f, i);
+			if (filebno - e->e_fileblk < e->e_len)
+				*pdiskbno = e->e_diskblk + (filebno - e->e_fileblk);
+		}
+		return 0;
+	}
+
+	if ((r = file_block_walk(f, filebno, &ptr, false)) < 0)
+		return r == -E_NOT_FOUND ? 0 : r;
+	*pdiskbno = *ptr;
+	return 0;
+}
+
+// Record that the filebno'th block of 'f', which is not allocated,
+// is stored in disk block 'diskbno'.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if the block map needed a block but the disk is full.
+//	-E_INVAL if filebno is out of range.
+static int
+file_set_block(struct File *f, uint32_t filebno, uint32_t diskbno)
+{
+	int r;
+	uint32_t *ptr;
+
+	if (f->f_flags & FILE_EXTENTS) {
+		if (filebno >= MAXEXTFILESIZE / BLKSIZE)
+			return -E_INVAL;
+		return extent_add(f, filebno, diskbno);
+	}
+
+	if ((r = file_block_walk(f, filebno, &ptr, true)) < 0)
+		return r;
+	*ptr = diskbno;
+	return 0;
+}
+
+// Make sure the filebno'th block of file 'f' has a disk block, and
+// set *pdiskbno to it.  A new block goes right after the disk
+// block of file block filebno-1 if that one is free, so files that
+// grow sequentially stay contiguous on disk.
+// Sets *palloced if a block was allocated.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if a block needed to be allocated but the disk is full.
+//	-E_INVAL if filebno is out of range.
+static int
+file_alloc_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno, bool *palloced)
+{
+	int r, bn;
+	uint32_t goal = 0, prev;
+
+	*palloced = 0;
+	if ((r = file_map_block(f, filebno, pdiskbno)) < 0)
+		return r;
+	if (*pdiskbno != 0)
+		return 0;
+
+	if (filebno > 0 && file_map_block(f, filebno - 1, &prev) == 0
+	    && prev != 0)
+		goal = prev + 1;
+	if ((bn = alloc_block_near(goal)) < 0)
+		return bn;
+	if ((r = file_set_block(f, filebno, bn)) < 0) {
+		free_block(bn);
+		return r;
+	}
+	*pdiskbno = bn;
+	*palloced = 1;
+	return 0;
+}
+
+// Having just allocated the last block of 'f', reserve the disk
+// blocks physically following it for the next file blocks, so that
+// a file written by appending stays contiguous even when other files
+// grow at the same time.  Stops at the first block that is not free.
+// Preallocated blocks lie past the end of the file; see
+// file_truncate_blocks.
+static void
+file_prealloc(struct File *f, uint32_t filebno)
+{
+	uint32_t i, prev, diskbno;
+
+	if (file_map_block(f, filebno, &prev) < 0 || prev == 0)
+		return;
+	for (i = 1; i < FILE_PREALLOC; i++) {
+		if (file_map_block(f, filebno + i, &diskbno) < 0
+		    || diskbno != 0 || !block_is_free(prev + 1))
+			return;
+		bitmap_take(prev + 1);
+		// The block map may need a block of its own, which then
+		// ends the run on the next iteration.
+		if (file_set_block(f, filebno + i, prev + 1) < 0) {
+			free_block(prev + 1);
+			return;
+		}
+		prev++;
+	}
+}
+
+// Largest size file 'f' can grow to.
+static off_t
+file_max_size(struct File *f)
+{
+	return (f->f_flags & FILE_EXTENTS) ? MAXEXTFILESIZE : MAXFILESIZE;
+}
+
+// Allocate disk blocks for bytes [offset, offset + len) of 'f',
+// extending the file if necessary, like fallocate.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if len is 0 or the range is past the maximum file size.
+//	-E_NO_DISK if the disk is full.
+int
+file_allocate(struct File *f, off_t offset, off_t len)
+{
+	uint32_t bno, diskbno;
+	bool alloced;
+	int r;
+
+	if (offset < 0 || len <= 0 || len > file_max_size(f) - offset)
+		return -E_INVAL;
+	for (bno = offset / BLKSIZE; bno <= (offset + len - 1) / BLKSIZE; bno++)
+		if ((r = file_alloc_block(f, bno, &diskbno, &alloced)) < 0)
+			return r;
+	if (offset + len > f->f_size)
+		f->f_size = offset + len;
+	return 0;
+}
+
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
 //
@@ -182,23 +565,167 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
        // LAB 5: Your code here.
         int r;
-        uint32_t *pdiskbno;
-        if ((r = file_block_walk(f, filebno, &pdiskbno, true)) < 0) {
+        uint32_t diskbno;
+        bool alloced;
+        if ((r = file_alloc_block(f, filebno, &diskbno, &alloced)) < 0) {
             return r;
         }
 
-        int bn;
-        if (*pdiskbno == 0) { 
-            if ((bn = alloc_block()) < 0) {
-                return bn;
-            }
-            *pdiskbno = bn;
-            flush_block(diskaddr(bn));
-        }
-        *blk = diskaddr(*pdiskbno);
+        // Appending: reserve the following blocks too
+        if (alloced && filebno == (f->f_size - 1) / BLKSIZE)
+            file_prealloc(f, filebno);
+        if (f->f_type == FTYPE_REG)
+            bc_mark_data(diskbno);
+        // Count a cache hit, or let other requests run while the
+        // block is read
+        if (!alloced)
+            bc_fetch(diskbno);
+        *blk = diskaddr(diskbno);
         return 0;
 }
 
+// Add the entry in slot 'slot' of hashed directory 'dir', whose name
+// hashes to 'hash', to the directory's index.  A full bucket is split
+// in two, doubling the index table first if the bucket already uses
+// every table bit.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if a bucket is needed and the disk is full, or the
+//		bucket is full at DIRHASH_MAXDEPTH.
+static int
+dirhash_insert(struct File *dir, uint32_t hash, uint32_t slot)
+{
+	struct DirIndex *di = diskaddr(dir->f_dirindex);
+	struct DirBucket *b, *nb;
+	uint32_t i, j, bno, bit;
+	int r;
+
+	while (1) {
+		bno = di->di_bucket[hash & ((1 << di->di_depth) - 1)];
+		b = diskaddr(bno);
+		if (b->db_n < DIRBUCKET_NENTS) {
+			b->db_ents[b->db_n].de_hash = hash;
+			b->db_ents[b->db_n].de_slot = slot;
+			b->db_n++;
+			return 0;
+		}
+
+		if (b->db_depth == di->di_depth) {
+			if (di->di_depth == DIRHASH_MAXDEPTH)
+				return -E_NO_DISK;
+			for (i = 0; i < (1 << di->di_depth); i++)
+				di->di_bucket[i + (1 << di->di_depth)] = di->di_bucket[i];
+			di->di_depth++;
+		}
+
+		if ((r = alloc_block()) < 0)
+			return r;
+		nb = diskaddr(r);
+		bit = 1 << b->db_depth;
+		nb->db_depth = ++b->db_depth;
+		nb->db_n = 0;
+		for (i = j = 0; i < b->db_n; i++)
+			if (b->db_ents[i].de_hash & bit)
+				nb->db_ents[nb->db_n++] = b->db_ents[i];
+			else
+				b->db_ents[j++] = b->db_ents[i];
+		b->db_n = j;
+		for (i = 0; i < (1 << di->di_depth); i++)
+			if (di->di_bucket[i] == bno && (i & bit))
+				di->di_bucket[i] = r;
+	}
+}
+
+// Free the hash index of 'dir', leaving a linear directory.
+static void
+dirhash_drop(struct File *dir)
+{
+	struct DirIndex *di = diskaddr(dir->f_dirindex);
+	uint32_t i;
+
+	// Buckets shared by several table slots are freed once;
+	// free_block ignores blocks that are already free.
+	for (i = 0; i < (1 << di->di_depth); i++)
+		free_block(di->di_bucket[i]);
+	free_block(dir->f_dirindex);
+	dir->f_dirindex = 0;
+	dir->f_flags &= ~FILE_DIRHASH;
+}
+
+// Build a hash index for the entries already in 'dir'.  On failure
+// the directory just stays linear.
+static void
+dirhash_build(struct File *dir)
+{
+	int r, bn;
+	uint32_t i, j, nblock;
+	struct DirIndex *di;
+	struct DirBucket *b;
+	struct File *f;
+	char *blk;
+
+	if ((r = alloc_block()) < 0)
+		return;
+	if ((bn = alloc_block()) < 0) {
+		free_block(r);
+		return;
+	}
+	di = diskaddr(r);
+	di->di_depth = 0;
+	di->di_bucket[0] = bn;
+	b = diskaddr(bn);
+	b->db_depth = 0;
+	b->db_n = 0;
+	dir->f_dirindex = r;
+	dir->f_flags |= FILE_DIRHASH;
+
+	nblock = dir->f_size / BLKSIZE;
+	for (i = 0; i < nblock; i++) {
+		if (file_get_block(dir, i, &blk) < 0)
+			goto fail;
+		f = (struct File*) blk;
+		for (j = 0; j < BLKFILES; j++)
+			if (f[j].f_name[0] != '\0'
+			    && dirhash_insert(dir, dir_hash(f[j].f_name),
+					      i * BLKFILES + j) < 0)
+				goto fail;
+	}
+	return;
+
+fail:
+	dirhash_drop(dir);
+}
+
+// dir_lookup for a directory with FILE_DIRHASH: only the entries in
+// the name's bucket with a matching hash are read.
+static int
+dirhash_lookup(struct File *dir, const char *name, struct File **file)
+{
+	struct DirIndex *di = diskaddr(dir->f_dirindex);
+	struct DirBucket *b;
+	uint32_t i, slot, hash = dir_hash(name);
+	struct File *f;
+	char *blk;
+	int r;
+
+	b = diskaddr(di->di_bucket[hash & ((1 << di->di_depth) - 1)]);
+	for (i = 0; i < b->db_n; i++) {
+		if (b->db_ents[i].de_hash != hash)
+			continue;
+		slot = b->db_ents[i].de_slot;
+		if (slot >= dir->f_size / BLKSIZE * BLKFILES)
+			continue;
+		if ((r = file_get_block(dir, slot / BLKFILES, &blk)) < 0)
+			return r;
+		f = (struct File*) blk + slot % BLKFILES;
+		if (strcmp(f->f_name, name) == 0) {
+			*file = f;
+			return 0;
+		}
+	}
+	return -E_NOT_FOUND;
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -215,6 +742,8 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
+	if (dir->f_flags & FILE_DIRHASH)
+		return dirhash_lookup(dir, name, file);
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
@@ -229,10 +758,12 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and *pslot to
+// its index in the directory.  The caller is responsible for filling
+// in the File fields.  Hashed directories only look in their last
+// block, so creating a file there does not scan the directory.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *pslot)
 {
 	int r;
 	uint32_t nblock, i, j;
@@ -241,13 +772,17 @@ dir_alloc_file(struct File *dir, struct File **file)
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+	i = 0;
+	if ((dir->f_flags & FILE_DIRHASH) && nblock > 0)
+		i = nblock - 1;
+	for (; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (f[j].f_name[0] == '\0') {
 				*file = &f[j];
+				*pslot = i * BLKFILES + j;
 				return 0;
 			}
 	}
@@ -256,6 +791,7 @@ dir_alloc_file(struct File *dir, struct File **file)
 		return r;
 	f = (struct File*) blk;
 	*file = &f[0];
+	*pslot = i * BLKFILES;
 	return 0;
 }
 
@@ -268,6 +804,126 @@ skip_slash(const char *p)
 	return p;
 }
 
+// --------------------------------------------------------------
+// Path-component cache
+// --------------------------------------------------------------
+
+// walk_path remembers the result of each dir_lookup, found or not,
+// keyed by (directory, name).  File structures stay at the same
+// address while cached blocks come and go, so the pointers remain
+// good until a directory loses entries.
+struct Dentry {
+	struct File *d_dir;		// NULL if the entry is unused
+	struct File *d_file;		// NULL for a negative entry
+	char d_name[MAXNAMELEN];
+	struct Dentry *d_hnext;		// Hash chain
+	struct Dentry *d_prev, *d_next;	// LRU list, most recent first
+};
+
+static struct Dentry dentries[DCACHE_SIZE];
+static struct Dentry *dcache_hash[DCACHE_NHASH];
+static struct Dentry *dcache_head, *dcache_tail;
+static int dcache_n;			// Entries handed out so far
+
+static struct Dentry **
+dcache_chain(struct File *dir, const char *name)
+{
+	return &dcache_hash[(dir_hash(name) ^ ((uintptr_t) dir / sizeof(struct File)))
+			    % DCACHE_NHASH];
+}
+
+static void
+dcache_unlink(struct Dentry *d)
+{
+	if (d->d_prev)
+		d->d_prev->d_next = d->d_next;
+	else
+		dcache_head = d->d_next;
+	if (d->d_next)
+		d->d_next->d_prev = d->d_prev;
+	else
+		dcache_tail = d->d_prev;
+}
+
+static void
+dcache_push(struct Dentry *d)
+{
+	d->d_prev = NULL;
+	d->d_next = dcache_head;
+	if (dcache_head)
+		dcache_head->d_prev = d;
+	else
+		dcache_tail = d;
+	dcache_head = d;
+}
+
+static struct Dentry *
+dcache_find(struct File *dir, const char *name)
+{
+	struct Dentry *d;
+
+	for (d = *dcache_chain(dir, name); d; d = d->d_hnext)
+		if (d->d_dir == dir && strcmp(d->d_name, name) == 0)
+			return d;
+	return NULL;
+}
+
+// Look up 'name' in 'dir' in the cache.  Returns 1 and sets *file,
+// to NULL if the name is known not to exist, or returns 0 if the
+// cache does not know.
+static int
+dcache_lookup(struct File *dir, const char *name, struct File **file)
+{
+	struct Dentry *d;
+
+	if (!(d = dcache_find(dir, name)))
+		return 0;
+	dcache_unlink(d);
+	dcache_push(d);
+	*file = d->d_file;
+	return 1;
+}
+
+// Remember that 'name' in 'dir' is 'file', or does not exist if file
+// is NULL, replacing the least recently used entry if necessary.
+static void
+dcache_enter(struct File *dir, const char *name, struct File *file)
+{
+	struct Dentry *d, **pp;
+
+	if ((d = dcache_find(dir, name))) {
+		dcache_unlink(d);
+	} else {
+		if (dcache_n < DCACHE_SIZE)
+			d = &dentries[dcache_n++];
+		else {
+			d = dcache_tail;
+			dcache_unlink(d);
+			for (pp = dcache_chain(d->d_dir, d->d_name); *pp != d; )
+				pp = &(*pp)->d_hnext;
+			*pp = d->d_hnext;
+		}
+		d->d_dir = dir;
+		strcpy(d->d_name, name);
+		pp = dcache_chain(dir, name);
+		d->d_hnext = *pp;
+		*pp = d;
+	}
+	d->d_file = file;
+	dcache_push(d);
+}
+
+// Forget everything.  Used when a directory loses entries: its
+// File slots, and those of any directories below it, may then be
+// reused for other files.
+static void
+dcache_clear(void)
+{
+	memset(dcache_hash, 0, sizeof(dcache_hash));
+	dcache_head = dcache_tail = NULL;
+	dcache_n = 0;
+}
+
 // Evaluate a path name, starting at the root.
 // On success, set *pf to the file we found
 // and set *pdir to the directory the file is in.
@@ -306,7 +962,13 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if (dcache_lookup(dir, name, &f))
+			r = f ? 0 : -E_NOT_FOUND;
+		else if ((r = dir_lookup(dir, name, &f)) == 0)
+			dcache_enter(dir, name, f);
+		else if (r == -E_NOT_FOUND)
+			dcache_enter(dir, name, NULL);
+		if (r < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -335,18 +997,32 @@ file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
+	uint32_t slot;
 	struct File *dir, *f;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, &f, &slot)) < 0)
 		return r;
 
+	// New files are extent-mapped.  Directory blocks are not
+	// cleared when allocated, so clear the entry first.
+	memset(f, 0, sizeof(*f));
 	strcpy(f->f_name, name);
+	f->f_flags = FILE_EXTENTS;
+
+	// Index directories once they outgrow a block.  A directory
+	// whose index fills up goes back to linear lookups.
+	if (dir->f_flags & FILE_DIRHASH) {
+		if (dirhash_insert(dir, dir_hash(name), slot) < 0)
+			dirhash_drop(dir);
+	} else if (dir->f_size > BLKSIZE)
+		dirhash_build(dir);
+	dcache_enter(dir, name, f);
+
 	*pf = f;
-	file_flush(dir);
 	return 0;
 }
 
@@ -414,7 +1090,8 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	return count;
 }
 
-// Remove a block from file f.  If it's not there, just silently succeed.
+// Remove a block from block-mapped file f.  If it's not there,
+// just silently succeed.
 // Returns 0 on success, < 0 on error.
 static int
 file_free_block(struct File *f, uint32_t filebno)
@@ -423,7 +1100,7 @@ file_free_block(struct File *f, uint32_t filebno)
 	uint32_t *ptr;
 
 	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
-		return r;
+		return r == -E_NOT_FOUND ? 0 : r;
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
@@ -435,10 +1112,12 @@ file_free_block(struct File *f, uint32_t filebno)
 // but not necessary for a file of size 'newsize'.
 // For both the old and new sizes, figure out the number of blocks required,
 // and then clear the blocks from new_nblocks to old_nblocks.
+// Blocks preallocated past the old end of the file are freed too.
 // If the new_nblocks is no more than NDIRECT, and the indirect block has
 // been allocated (f->f_indirect != 0), then free the indirect block too.
 // (Remember to clear the f->f_indirect pointer so you'll know
 // whether it's valid!)
+// Extent-mapped files are cut back by extent_truncate instead.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
@@ -446,7 +1125,13 @@ file_truncate_blocks(struct File *f, off_t newsize)
 	int r;
 	uint32_t bno, old_nblocks, new_nblocks;
 
-	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	if (f->f_flags & FILE_EXTENTS) {
+		extent_truncate(f, (newsize + BLKSIZE - 1) / BLKSIZE);
+		return;
+	}
+
+	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE + FILE_PREALLOC - 1;
+	old_nblocks = MIN(old_nblocks, NDIRECT + NINDIRECT);
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
 	for (bno = new_nblocks; bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
@@ -462,41 +1147,30 @@ file_truncate_blocks(struct File *f, off_t newsize)
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	if (f->f_size > newsize) {
+		if (f->f_type == FTYPE_DIR)
+			dcache_clear();
 		file_truncate_blocks(f, newsize);
+	}
 	f->f_size = newsize;
-	flush_block(f);
 	return 0;
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// The block cache only knows which blocks are dirty, not which file
+// they belong to, so this writes back every dirty block; that costs
+// O(dirty blocks) rather than a walk over the file's blocks.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
-
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
-	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	bc_sync();
 }
 
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync();
 }
 
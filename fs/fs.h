@@ -11,23 +11,118 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Maximum number of blocks the block cache keeps in memory, not
+ * counting the superblock and bitmap */
+#define BCSLOTS		512
+
+/* Dirty blocks that trigger write-back, and the most requests dirty
+ * blocks may wait for it; see bc_writeback */
+#define BC_WB_DIRTY	(BCSLOTS / 4)
+#define BC_WB_REQS	32
+
+/* Path components the lookup cache remembers, and the number of
+ * hash chains it keeps them on */
+#define DCACHE_SIZE	256
+#define DCACHE_NHASH	64
+
+/* Blocks reserved at once when a file grows at its end */
+#define FILE_PREALLOC	8
+
+/* Requests the server works on at once, each on its own thread */
+#define FS_NTHREADS	8
+
+/* Pages that block reads on server threads land in before they are
+ * mapped into the cache: BC_RAMAX of them per thread */
+#define THREADSTAGE	0x0f000000
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
+/* pci.c */
+struct PciFunc {
+	uint32_t pf_bus, pf_dev, pf_func;
+	uint16_t pf_vendor, pf_device;
+	uint8_t pf_class, pf_subclass, pf_progif;
+	uint8_t pf_irq;			// Interrupt line
+};
+
+// Configuration space registers (dword offsets)
+#define PCI_ID		0x00	// Vendor and device ID
+#define PCI_CMD		0x04	// Command and status
+#define PCI_CLASS	0x08	// Class, subclass, prog-if, revision
+#define PCI_BHLC	0x0C	// Header type and others
+#define PCI_BAR(n)	(0x10 + 4 * (n))
+#define PCI_INTR	0x3C	// Interrupt line and pin
+
+#define PCI_CMD_IO	0x1	// Respond to I/O space accesses
+#define PCI_CMD_MEM	0x2	// Respond to memory space accesses
+#define PCI_CMD_MASTER	0x4	// May act as bus master
+#define PCI_HDR_MULTIFN	0x00800000	// Device has several functions
+
+uint32_t pci_conf_read(struct PciFunc *f, uint32_t off);
+void	pci_conf_write(struct PciFunc *f, uint32_t off, uint32_t v);
+int	pci_find_class(uint8_t class, uint8_t subclass, struct PciFunc *f);
+int	pci_find_device(uint16_t vendor, uint16_t device, struct PciFunc *f);
+
+/* disk.c */
+// A block transfer queued with disk_submit
+struct BlkReq {
+	uint32_t br_secno;
+	void *br_buf;
+	size_t br_nsecs;
+	bool br_write;
+	bool br_done;			// Set once br_result is valid
+	int br_result;
+	int br_dev;			// IDE disk, for the driver
+	struct BlkReq *br_next;		// Next in the driver's queue
+	struct BlkReq *br_parent;	// Striped request this is part of
+	uint32_t br_npieces;		// Parts of a striped request still busy
+};
+
+void	disk_init(void);
+int	disk_read(uint32_t secno, void *dst, size_t nsecs);
+int	disk_write(uint32_t secno, const void *src, size_t nsecs);
+void	disk_submit(struct BlkReq *req);
+int	disk_wait(struct BlkReq *req);
+void	disk_intr(int irq);
+bool	disk_async(void);
+
 /* ide.c */
+void	ide_init(void);
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
-int	ide_read(uint32_t secno, void *dst, size_t nsecs);
-int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+void	ide_submit(struct BlkReq *req);
+int	ide_wait(struct BlkReq *req);
+void	ide_intr(void);
+bool	ide_async(void);
+
+/* virtio.c */
+int	virtio_init(void);
+void	virtio_submit(struct BlkReq *req);
+int	virtio_wait(struct BlkReq *req);
+void	virtio_intr(void);
+bool	virtio_async(void);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_fetch(uint32_t blockno);
+void	bc_sync(void);
+void	bc_writeback(void);
+void	bc_mark_data(uint32_t blockno);
+void	bc_mark_meta(uint32_t blockno);
+void	bc_report(void);
 void	bc_init(void);
 
+/* journal.c */
+void	journal_init(void);
+uint32_t journal_capacity(void);
+void	journal_commit(const uint32_t *blocknos, uint32_t n);
+void	journal_clear(void);
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
@@ -36,13 +131,25 @@ int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
+int	file_allocate(struct File *f, off_t offset, off_t len);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
+void	free_block(uint32_t blockno);
+void	bitmap_release(void);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
+
+/* thread.c */
+void	thread_init(void);
+int	thread_create(void (*fn)(void *), void *arg);
+int	thread_id(void);
+int	thread_schedule(void);
+int	thread_wait_io(struct BlkReq *req);
+void	thread_wait_any(void);
 
 /* test.c */
 void	fs_test(void);
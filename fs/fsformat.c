@@ -33,6 +33,11 @@ typedef int bool;
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
 #define MAX_DIR_ENTS 128
+// Largest disk the file server can map (DISKSIZE in fs/fs.h)
+#define MAX_NBLOCKS (0xC0000000 / BLKSIZE)
+// As in fs/fs.h
+#define SECTSIZE 512
+#define BLKSECTS (BLKSIZE / SECTSIZE)
 
 struct Dir
 {
@@ -43,6 +48,10 @@ struct Dir
 
 uint32_t nblocks;
 char *diskmap, *diskpos;
+// Striped volumes: stripe unit in sectors (0 for a plain image) and
+// the member images
+uint32_t stripe;
+const char *member[STRIPE_NMEMBERS];
 struct Super *super;
 uint32_t *bitmap;
 
@@ -93,18 +102,25 @@ opendisk(const char *name)
 {
 	int r, diskfd, nbitblocks;
 
-	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
-		panic("open %s: %s", name, strerror(errno));
+	if (stripe) {
+		// Build the volume in memory; finishdisk splits it up
+		if ((diskmap = mmap(NULL, nblocks * BLKSIZE, PROT_READ|PROT_WRITE,
+				    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			panic("mmap: %s", strerror(errno));
+	} else {
+		if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
+			panic("open %s: %s", name, strerror(errno));
 
-	if ((r = ftruncate(diskfd, 0)) < 0
-	    || (r = ftruncate(diskfd, nblocks * BLKSIZE)) < 0)
-		panic("truncate %s: %s", name, strerror(errno));
+		if ((r = ftruncate(diskfd, 0)) < 0
+		    || (r = ftruncate(diskfd, nblocks * BLKSIZE)) < 0)
+			panic("truncate %s: %s", name, strerror(errno));
 
-	if ((diskmap = mmap(NULL, nblocks * BLKSIZE, PROT_READ|PROT_WRITE,
-			    MAP_SHARED, diskfd, 0)) == MAP_FAILED)
-		panic("mmap %s: %s", name, strerror(errno));
+		if ((diskmap = mmap(NULL, nblocks * BLKSIZE, PROT_READ|PROT_WRITE,
+				    MAP_SHARED, diskfd, 0)) == MAP_FAILED)
+			panic("mmap %s: %s", name, strerror(errno));
 
-	close(diskfd);
+		close(diskfd);
+	}
 
 	diskpos = diskmap;
 	alloc(BLKSIZE);
@@ -117,6 +133,70 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// The journal starts out empty: the image is zero-filled
+	super->s_journal = blockof(alloc(JOURNAL_NBLOCKS * BLKSIZE));
+	super->s_njournal = JOURNAL_NBLOCKS;
+}
+
+void
+writen(int f, const void *in, size_t n, off_t off, const char *name)
+{
+	size_t p = 0;
+	while (p < n) {
+		ssize_t m = pwrite(f, in + p, n - p, off + p);
+		if (m < 0)
+			panic("write %s: %s", name, strerror(errno));
+		p += m;
+	}
+}
+
+// Write the volume out to the member images, alternating between them
+// every 'stripe' sectors.  Member 1's image is created from scratch;
+// member 0 goes after whatever its image already holds (normally a
+// copy of the boot image), at the next block boundary.
+void
+writestripes(void)
+{
+	struct StripeLabel label;
+	struct stat st;
+	uint32_t nsect, sect, m, i;
+	int fd[STRIPE_NMEMBERS];
+	char lblock[BLKSIZE];
+
+	nsect = nblocks * BLKSECTS / STRIPE_NMEMBERS;
+	memset(&label, 0, sizeof(label));
+	label.sl_magic = STRIPE_MAGIC;
+	label.sl_stripe = stripe;
+	label.sl_nsect = nsect;
+
+	for (m = 0; m < STRIPE_NMEMBERS; m++) {
+		if ((fd[m] = open(member[m], O_RDWR | O_CREAT | (m ? O_TRUNC : 0),
+				  0666)) < 0)
+			panic("open %s: %s", member[m], strerror(errno));
+		if (fstat(fd[m], &st) < 0)
+			panic("stat %s: %s", member[m], strerror(errno));
+		label.sl_start[m] = ROUNDUP((uint32_t) st.st_size, BLKSIZE) / SECTSIZE;
+		if (m == 0 && label.sl_start[m] == 0)
+			label.sl_start[m] = BLKSECTS;	// Keep sector 0 for a boot block
+	}
+
+	for (m = 0; m < STRIPE_NMEMBERS; m++) {
+		memset(lblock, 0, sizeof(lblock));
+		label.sl_member = m;
+		memmove(lblock, &label, sizeof(label));
+		writen(fd[m], lblock, BLKSIZE, (off_t) label.sl_start[m] * SECTSIZE,
+		       member[m]);
+	}
+	for (sect = 0; sect < nblocks * BLKSECTS; sect += stripe) {
+		m = (sect / stripe) % STRIPE_NMEMBERS;
+		i = (sect / stripe / STRIPE_NMEMBERS) * stripe;
+		writen(fd[m], diskmap + sect * SECTSIZE, stripe * SECTSIZE,
+		       (off_t) (label.sl_start[m] + BLKSECTS + i) * SECTSIZE,
+		       member[m]);
+	}
+	for (m = 0; m < STRIPE_NMEMBERS; m++)
+		close(fd[m]);
 }
 
 void
@@ -127,23 +207,24 @@ finishdisk(void)
 	for (i = 0; i < blockof(diskpos); ++i)
 		bitmap[i/32] &= ~(1<<(i%32));
 
-	if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
+	if (stripe)
+		writestripes();
+	else if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
 		panic("msync: %s", strerror(errno));
 }
 
+// Files are laid out contiguously, so each is a single extent.
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
 	f->f_size = len;
+	f->f_flags = FILE_EXTENTS;
 	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
+	if (len > 0) {
+		f->f_nextents = 1;
+		f->f_extents[0].e_fileblk = 0;
+		f->f_extents[0].e_diskblk = start;
+		f->f_extents[0].e_len = len / BLKSIZE;
 	}
 }
 
@@ -166,6 +247,47 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	return out;
 }
 
+// Index the n entries of directory f, at slots 0 to n-1.  Every
+// bucket uses the same number of hash bits: the fewest that fit.
+void
+indexdir(struct File *f, struct File *ents, int n)
+{
+	struct DirIndex *di;
+	struct DirBucket *b;
+	uint32_t depth, hash, nbuckets, *count;
+	int i, full;
+
+	for (depth = 0; depth <= DIRHASH_MAXDEPTH; depth++) {
+		nbuckets = 1 << depth;
+		count = calloc(nbuckets, sizeof(*count));
+		for (i = full = 0; i < n; i++)
+			if (++count[dir_hash(ents[i].f_name) % nbuckets] > DIRBUCKET_NENTS)
+				full = 1;
+		free(count);
+		if (!full)
+			break;
+	}
+	if (depth > DIRHASH_MAXDEPTH)
+		return;
+
+	di = alloc(BLKSIZE);
+	di->di_depth = depth;
+	for (i = 0; i < nbuckets; i++) {
+		b = alloc(BLKSIZE);
+		b->db_depth = depth;
+		di->di_bucket[i] = blockof(b);
+	}
+	for (i = 0; i < n; i++) {
+		hash = dir_hash(ents[i].f_name);
+		b = (struct DirBucket *) (diskmap + di->di_bucket[hash % nbuckets] * BLKSIZE);
+		b->db_ents[b->db_n].de_hash = hash;
+		b->db_ents[b->db_n].de_slot = i;
+		b->db_n++;
+	}
+	f->f_dirindex = blockof(di);
+	f->f_flags |= FILE_DIRHASH;
+}
+
 void
 finishdir(struct Dir *d)
 {
@@ -173,6 +295,9 @@ finishdir(struct Dir *d)
 	struct File *start = alloc(size);
 	memmove(start, d->ents, size);
 	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	// The file server indexes directories once they outgrow a block
+	if (d->n > BLKFILES)
+		indexdir(d->f, start, d->n);
 	free(d->ents);
 	d->ents = NULL;
 }
@@ -192,7 +317,7 @@ writefile(struct Dir *dir, const char *name)
 		panic("stat %s: %s", name, strerror(errno));
 	if (!S_ISREG(st.st_mode))
 		panic("%s is not a regular file", name);
-	if (st.st_size >= MAXFILESIZE)
+	if (st.st_size >= MAXEXTFILESIZE)
 		panic("%s too large", name);
 
 	last = strrchr(name, '/');
@@ -211,7 +336,12 @@ writefile(struct Dir *dir, const char *name)
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n"
+		"       fsformat -s STRIPE disk0.img disk1.img NBLOCKS files...\n"
+		"The second form stripes the file system over two IDE disks\n"
+		"every STRIPE sectors (a multiple of %d).  disk0.img keeps its contents (such as\n"
+		"the boot image) and its share of the file system goes after.\n",
+		BLKSECTS);
 	exit(2);
 }
 
@@ -224,12 +354,27 @@ main(int argc, char **argv)
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
+	if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+		if (argc < 6)
+			usage();
+		stripe = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || stripe == 0 || stripe % BLKSECTS != 0)
+			usage();
+		member[0] = argv[3];
+		member[1] = argv[4];
+		argc -= 3;
+		argv += 3;
+	}
+
 	if (argc < 3)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > MAX_NBLOCKS)
 		usage();
+	// A striped volume is a whole number of stripes on each member
+	if (stripe)
+		nblocks = ROUNDUP(nblocks, STRIPE_NMEMBERS * stripe / BLKSECTS);
 
 	opendisk(argv[1]);
 
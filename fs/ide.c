@@ -1,5 +1,9 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.  Transfers use PCI bus-master DMA when the
+ * controller supports it, and polled PIO otherwise.  DMA transfers
+ * complete by interrupt: the kernel hands IRQ 14 to us, and we sleep
+ * in sys_irq_wait rather than spin.  Outstanding transfers wait in a
+ * queue kept in sector order and are started elevator-fashion.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,7 +16,58 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
-static int diskno = 1;
+#define IDE_CMD_READ		0x20
+#define IDE_CMD_WRITE		0x30
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
+// Bus-master IDE registers (primary channel), relative to BAR 4 of
+// the controller.  See the Intel PIIX datasheet.
+#define BM_CMD		0	// Command
+#define BM_STATUS	2	// Status
+#define BM_PRDT		4	// Physical address of the PRD table
+
+#define BM_CMD_START	0x01	// Start the transfer
+#define BM_CMD_READ	0x08	// Transfer from the disk to memory
+#define BM_ST_ACTIVE	0x01	// Transfer in progress
+#define BM_ST_ERR	0x02	// Transfer failed (write 1 to clear)
+#define BM_ST_INTR	0x04	// Device interrupted (write 1 to clear)
+
+// Physical region descriptor: one physically contiguous piece of
+// the buffer.
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_len;
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// Last descriptor in the table
+
+// A 256-sector transfer covers at most this many pages
+#define NPRD		(256 * SECTSIZE / PGSIZE + 1)
+
+static int diskno = 1;		// Disk ide_set_partition applies to
+
+// Partition of each disk that requests address; nsect 0 for the whole
+// disk
+static struct {
+	uint32_t start;
+	uint32_t nsect;
+} ide_part[2];
+
+// The table is page-aligned, so it does not cross a 64KB boundary
+static struct Prd prdt[NPRD] __attribute__((aligned(PGSIZE)));
+static physaddr_t prdt_pa;
+static uint16_t bmiba;		// Bus-master I/O base, 0 to use PIO
+static bool ide_irq;		// IRQ_IDE is delivered to us
+
+// Requests not yet started, sorted by disk and sector (IDE_KEY).
+// ide_dispatch starts the first one at or beyond ide_head, the key
+// just past the last transfer, wrapping around to the lowest (a
+// one-way elevator).
+#define IDE_KEY(dev, secno)	(((uint64_t) (dev) << 32) | (secno))
+static struct BlkReq *ide_queue;
+static struct BlkReq *ide_active;	// DMA transfer in flight
+static uint64_t ide_head;
 
 static int
 ide_wait_ready(bool check_error)
@@ -27,6 +82,42 @@ ide_wait_ready(bool check_error)
 	return 0;
 }
 
+// Look for a PCI IDE controller that can do bus-master DMA.
+void
+ide_init(void)
+{
+	struct PciFunc f;
+	uint32_t bar;
+	int r;
+
+	// Class 1 (mass storage), subclass 1 (IDE); bit 7 of the
+	// programming interface says the controller is a bus master.
+	if (pci_find_class(0x01, 0x01, &f) < 0 || !(f.pf_progif & 0x80)) {
+		cprintf("ide: no bus-master controller, using PIO\n");
+		return;
+	}
+	bar = pci_conf_read(&f, PCI_BAR(4));
+	if (!(bar & 1) || (bar & 0xFFFC) == 0) {
+		cprintf("ide: bus-master registers not in I/O space, using PIO\n");
+		return;
+	}
+	if ((r = sys_page_paddr(prdt, &prdt_pa)) < 0) {
+		cprintf("ide: sys_page_paddr: %e, using PIO\n", r);
+		return;
+	}
+
+	pci_conf_write(&f, PCI_CMD, pci_conf_read(&f, PCI_CMD)
+		       | PCI_CMD_IO | PCI_CMD_MASTER);
+	bmiba = bar & 0xFFFC;
+	cprintf("ide: bus-master DMA at port 0x%x (PCI %04x:%04x)\n",
+		bmiba, f.pf_vendor, f.pf_device);
+
+	if ((r = sys_irq_attach(IRQ_IDE)) < 0)
+		cprintf("ide: sys_irq_attach: %e, polling\n", r);
+	else
+		ide_irq = 1;
+}
+
 bool
 ide_probe_disk1(void)
 {
@@ -59,54 +150,202 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
+// Confine requests for the disk chosen with ide_set_disk to nsect
+// sectors starting at first_sect, and number them from there.
+void
+ide_set_partition(uint32_t first_sect, uint32_t nsect)
+{
+	ide_part[diskno].start = first_sect;
+	ide_part[diskno].nsect = nsect;
+}
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+// Issue ATA command 'cmd' for req.
+static void
+ide_start(struct BlkReq *req, int cmd)
 {
-	int r;
+	uint32_t secno = ide_part[req->br_dev].start + req->br_secno;
 
-	assert(nsecs <= 256);
+	assert(req->br_nsecs <= 256);
 
 	ide_wait_ready(0);
 
-	outb(0x1F2, nsecs);
+	outb(0x1F2, req->br_nsecs);
 	outb(0x1F3, secno & 0xFF);
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F6, 0xE0 | ((req->br_dev&1)<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, cmd);
+}
 
-	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
-			return r;
-		insl(0x1F0, dst, SECTSIZE/4);
+// Start req by bus-master DMA.
+//
+// Returns 0 on success, -E_INVAL if there is no DMA controller or the
+// buffer cannot be used for DMA (not word aligned, or not mapped).
+static int
+ide_dma_start(struct BlkReq *req)
+{
+	uintptr_t va = (uintptr_t) req->br_buf;
+	size_t len = req->br_nsecs * SECTSIZE, n;
+	physaddr_t pa;
+	int i, dir = req->br_write ? 0 : BM_CMD_READ;
+
+	if (!bmiba || (va & 3) || req->br_nsecs == 0 || req->br_nsecs > 256)
+		return -E_INVAL;
+
+	// One descriptor per page; pages are not physically contiguous
+	for (i = 0; len > 0; i++, va += n, len -= n) {
+		n = MIN(len, PGSIZE - PGOFF(va));
+		if (sys_page_paddr((void *) va, &pa) < 0)
+			return -E_INVAL;
+		prdt[i].prd_addr = pa;
+		prdt[i].prd_len = n;
+		prdt[i].prd_flags = 0;
 	}
+	prdt[i - 1].prd_flags = PRD_EOT;
 
+	outl(bmiba + BM_PRDT, prdt_pa);
+	outb(bmiba + BM_CMD, dir);
+	outb(bmiba + BM_STATUS, inb(bmiba + BM_STATUS) | BM_ST_ERR | BM_ST_INTR);
+	ide_start(req, req->br_write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+	outb(bmiba + BM_CMD, dir | BM_CMD_START);
 	return 0;
 }
 
-int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+// Is the DMA transfer still going?
+static bool
+ide_dma_busy(void)
 {
-	int r;
+	return (inb(bmiba + BM_STATUS) & (BM_ST_ACTIVE | BM_ST_ERR | BM_ST_INTR))
+		== BM_ST_ACTIVE;
+}
 
-	assert(nsecs <= 256);
+// Finish a DMA transfer that is no longer busy.
+// Returns 0 on success, -1 if the transfer failed.
+static int
+ide_dma_finish(bool write)
+{
+	int r, st;
 
-	ide_wait_ready(0);
+	st = inb(bmiba + BM_STATUS);
+	outb(bmiba + BM_CMD, write ? 0 : BM_CMD_READ);
+	r = ide_wait_ready(1);
+	outb(bmiba + BM_STATUS, inb(bmiba + BM_STATUS) | BM_ST_ERR | BM_ST_INTR);
+	if ((st & BM_ST_ERR) || r < 0)
+		return -1;
+	return 0;
+}
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+// Transfer a request by PIO.
+static int
+ide_pio(struct BlkReq *req)
+{
+	char *buf = req->br_buf;
+	size_t nsecs = req->br_nsecs;
+	int r;
 
-	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
+	ide_start(req, req->br_write ? IDE_CMD_WRITE : IDE_CMD_READ);
+
+	for (; nsecs > 0; nsecs--, buf += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
 			return r;
-		outsl(0x1F0, src, SECTSIZE/4);
+		if (req->br_write)
+			outsl(0x1F0, buf, SECTSIZE/4);
+		else
+			insl(0x1F0, buf, SECTSIZE/4);
 	}
 
 	return 0;
 }
 
+// Start queued requests until one is in flight by DMA or the queue is
+// empty.  Requests DMA cannot handle are done by PIO on the spot.
+static void
+ide_dispatch(void)
+{
+	struct BlkReq **pp, **next, *req;
+
+	while (!ide_active && ide_queue) {
+		next = &ide_queue;
+		for (pp = &ide_queue; *pp; pp = &(*pp)->br_next)
+			if (IDE_KEY((*pp)->br_dev, (*pp)->br_secno) >= ide_head) {
+				next = pp;
+				break;
+			}
+		req = *next;
+		*next = req->br_next;
+		ide_head = IDE_KEY(req->br_dev, req->br_secno + req->br_nsecs);
+
+		if (ide_dma_start(req) == 0)
+			ide_active = req;
+		else {
+			req->br_result = ide_pio(req);
+			req->br_done = 1;
+		}
+	}
+}
+
+// Queue a transfer on IDE disk req->br_dev.  Its buffer must stay put
+// until ide_wait returns.
+void
+ide_submit(struct BlkReq *req)
+{
+	struct BlkReq **pp;
+	uint64_t key;
+
+	req->br_done = 0;
+	if (req->br_dev < 0 || req->br_dev > 1
+	    || (ide_part[req->br_dev].nsect
+		&& (req->br_secno > ide_part[req->br_dev].nsect
+		    || req->br_nsecs > ide_part[req->br_dev].nsect - req->br_secno))) {
+		req->br_result = -E_INVAL;
+		req->br_done = 1;
+		return;
+	}
+	key = IDE_KEY(req->br_dev, req->br_secno);
+	for (pp = &ide_queue;
+	     *pp && IDE_KEY((*pp)->br_dev, (*pp)->br_secno) <= key;
+	     pp = &(*pp)->br_next)
+		/* do nothing */;
+	req->br_next = *pp;
+	*pp = req;
+	ide_dispatch();
+}
+
+// Complete the DMA transfer in flight, if it is done, and start the
+// next.  A transfer that failed is done again by PIO on the spot.
+// Called on IRQ_IDE, and harmless at any other time.
+void
+ide_intr(void)
+{
+	struct BlkReq *req;
+
+	if (!ide_active || ide_dma_busy())
+		return;
+	req = ide_active;
+	ide_active = NULL;
+	if ((req->br_result = ide_dma_finish(req->br_write)) < 0)
+		req->br_result = ide_pio(req);
+	req->br_done = 1;
+	ide_dispatch();
+}
+
+// Do DMA transfers complete by interrupt?
+bool
+ide_async(void)
+{
+	return ide_irq;
+}
+
+// Wait for a submitted request to complete and return its result:
+// 0 on success, < 0 on error.
+int
+ide_wait(struct BlkReq *req)
+{
+	while (!req->br_done) {
+		// Interrupts left over from PIO transfers may wake us early
+		if (ide_irq && ide_active && ide_dma_busy())
+			sys_irq_wait(IRQ_IDE);
+		ide_intr();
+	}
+	return req->br_result;
+}
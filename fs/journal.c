@@ -0,0 +1,145 @@
+#include "fs.h"
+
+// Write-ahead journal for metadata.  bc_sync hands each batch of
+// dirty metadata blocks to journal_commit, which writes copies of
+// them and a header into the journal region with a single disk
+// write, before bc_sync writes them to their home locations and calls
+// journal_clear.  If we crash in between, journal_init finds the
+// committed transaction at the next boot and writes it again.
+//
+// Only the latest transaction is ever in the journal, and it is
+// cleared once its blocks are home, so a replay never overwrites
+// anything newer.
+
+// Staging area: the header, then the block copies
+static char jbuf[JOURNAL_NBLOCKS][BLKSIZE] __attribute__((aligned(PGSIZE)));
+static struct JournalHeader *jhdr = (struct JournalHeader *) jbuf[0];
+
+static bool journal_active;
+static uint32_t journal_seq;
+
+static uint32_t
+journal_sum_words(uint32_t sum, const uint32_t *p, uint32_t nwords)
+{
+	uint32_t i;
+
+	for (i = 0; i < nwords; i++)
+		sum = ((sum << 5) | (sum >> 27)) + p[i];
+	return sum;
+}
+
+// Checksum of the transaction in jbuf: the header's sequence number,
+// block count and home locations, then the jh_n block copies, so a
+// damaged header cannot send good copies to the wrong blocks.
+static uint32_t
+journal_sum(void)
+{
+	uint32_t sum;
+
+	sum = journal_sum_words(0, &jhdr->jh_seq, 1);
+	sum = journal_sum_words(sum, &jhdr->jh_n, 1);
+	sum = journal_sum_words(sum, jhdr->jh_blockno, jhdr->jh_n);
+	return journal_sum_words(sum, (uint32_t *) jbuf[1],
+				 jhdr->jh_n * BLKSIZE / 4);
+}
+
+// Largest number of blocks journal_commit takes at once, 0 if there
+// is no journal.
+uint32_t
+journal_capacity(void)
+{
+	if (!journal_active)
+		return 0;
+	return MIN(super->s_njournal, JOURNAL_NBLOCKS) - 1;
+}
+
+// Log the n blocks listed in blocknos as one transaction.  The blocks
+// must be mapped in the block cache.
+void
+journal_commit(const uint32_t *blocknos, uint32_t n)
+{
+	uint32_t i;
+	int r;
+
+	assert(n > 0 && n <= journal_capacity());
+	for (i = 0; i < n; i++)
+		memmove(jbuf[1 + i], diskaddr(blocknos[i]), BLKSIZE);
+	jhdr->jh_magic = JOURNAL_MAGIC;
+	jhdr->jh_seq = ++journal_seq;
+	jhdr->jh_n = n;
+	memmove(jhdr->jh_blockno, blocknos, n * sizeof(uint32_t));
+	jhdr->jh_sum = journal_sum();
+
+	if ((r = disk_write(super->s_journal * BLKSECTS, jbuf,
+			   (1 + n) * BLKSECTS)) < 0)
+		panic("journal_commit: disk_write: %e", r);
+}
+
+// Mark the journal empty, once the last transaction's blocks are home.
+// Only the first sector of the header needs rewriting.
+void
+journal_clear(void)
+{
+	int r;
+
+	memset(jhdr, 0, SECTSIZE);
+	if ((r = disk_write(super->s_journal * BLKSECTS, jhdr, 1)) < 0)
+		panic("journal_clear: disk_write: %e", r);
+}
+
+// Replay a committed transaction left in the journal, if any, and
+// start journaling.  Called from fs_init before anything but the
+// superblock has been read.
+void
+journal_init(void)
+{
+	uint32_t i, b, n;
+	void *va;
+	int r;
+
+	if (super->s_journal == 0)
+		return;
+	if (super->s_njournal < 2 || super->s_journal < 2
+	    || super->s_journal + super->s_njournal > super->s_nblocks)
+		panic("bad journal location %d+%d", super->s_journal,
+		      super->s_njournal);
+
+	if ((r = disk_read(super->s_journal * BLKSECTS, jbuf, BLKSECTS)) < 0)
+		panic("journal_init: disk_read: %e", r);
+	n = jhdr->jh_n;
+	if (jhdr->jh_magic != JOURNAL_MAGIC || n == 0)
+		goto done;
+	if (n > MIN(super->s_njournal, JOURNAL_NBLOCKS) - 1)
+		panic("journal transaction too large: %d blocks", n);
+
+	if ((r = disk_read((super->s_journal + 1) * BLKSECTS, jbuf[1],
+			  n * BLKSECTS)) < 0)
+		panic("journal_init: disk_read: %e", r);
+	if (journal_sum() != jhdr->jh_sum) {
+		cprintf("journal: discarding incomplete transaction %d\n",
+			jhdr->jh_seq);
+		goto done;
+	}
+
+	for (i = 0; i < n; i++) {
+		b = jhdr->jh_blockno[i];
+		if (b < 1 || b >= super->s_nblocks
+		    || (b >= super->s_journal
+			&& b < super->s_journal + super->s_njournal))
+			panic("journal block %d has bad home %d", i, b);
+		if ((r = disk_write(b * BLKSECTS, jbuf[1 + i], BLKSECTS)) < 0)
+			panic("journal_init: disk_write: %e", r);
+		// Drop any stale cached copy (only the superblock can
+		// have been read so far)
+		va = (char*) (DISKMAP + b * BLKSIZE);
+		if (va_is_mapped(va) && (r = sys_page_unmap(0, va)) < 0)
+			panic("journal_init: sys_page_unmap: %e", r);
+	}
+	cprintf("journal: replayed transaction %d, %d blocks\n",
+		jhdr->jh_seq, n);
+	journal_seq = jhdr->jh_seq;
+
+done:
+	journal_clear();
+	journal_active = 1;
+}
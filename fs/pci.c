@@ -0,0 +1,97 @@
+// PCI configuration space access for the file system server, which
+// has I/O privilege.  Uses configuration mechanism #1 (ports 0xCF8 and
+// 0xCFC).
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+
+static void
+pci_conf_select(struct PciFunc *f, uint32_t off)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (f->pf_bus << 16) | (f->pf_dev << 11)
+	     | (f->pf_func << 8) | (off & 0xFC));
+}
+
+uint32_t
+pci_conf_read(struct PciFunc *f, uint32_t off)
+{
+	pci_conf_select(f, off);
+	return inl(PCI_CONF_DATA);
+}
+
+void
+pci_conf_write(struct PciFunc *f, uint32_t off, uint32_t v)
+{
+	pci_conf_select(f, off);
+	outl(PCI_CONF_DATA, v);
+}
+
+// Scan every bus for the first function match(f, arg) accepts, with
+// *f filled in.  Returns 0 on success, -E_NOT_FOUND if there is none.
+static int
+pci_scan(bool (*match)(struct PciFunc *, void *), void *arg, struct PciFunc *f)
+{
+	uint32_t id, cls, nfunc;
+
+	for (f->pf_bus = 0; f->pf_bus < 256; f->pf_bus++)
+		for (f->pf_dev = 0; f->pf_dev < 32; f->pf_dev++) {
+			f->pf_func = 0;
+			if ((pci_conf_read(f, PCI_ID) & 0xFFFF) == 0xFFFF)
+				continue;
+			nfunc = (pci_conf_read(f, PCI_BHLC) & PCI_HDR_MULTIFN) ? 8 : 1;
+			for (f->pf_func = 0; f->pf_func < nfunc; f->pf_func++) {
+				id = pci_conf_read(f, PCI_ID);
+				if ((id & 0xFFFF) == 0xFFFF)
+					continue;
+				cls = pci_conf_read(f, PCI_CLASS);
+				f->pf_vendor = id & 0xFFFF;
+				f->pf_device = id >> 16;
+				f->pf_class = cls >> 24;
+				f->pf_subclass = (cls >> 16) & 0xFF;
+				f->pf_progif = (cls >> 8) & 0xFF;
+				f->pf_irq = pci_conf_read(f, PCI_INTR) & 0xFF;
+				if (match(f, arg))
+					return 0;
+			}
+		}
+	return -E_NOT_FOUND;
+}
+
+static bool
+pci_match_class(struct PciFunc *f, void *arg)
+{
+	uint8_t *cls = arg;
+
+	return f->pf_class == cls[0] && f->pf_subclass == cls[1];
+}
+
+static bool
+pci_match_device(struct PciFunc *f, void *arg)
+{
+	uint16_t *id = arg;
+
+	return f->pf_vendor == id[0] && f->pf_device == id[1];
+}
+
+// Find the first function with the given class and subclass and fill
+// in *f.  Returns 0 on success, -E_NOT_FOUND if there is none.
+int
+pci_find_class(uint8_t class, uint8_t subclass, struct PciFunc *f)
+{
+	uint8_t cls[2] = { class, subclass };
+
+	return pci_scan(pci_match_class, cls, f);
+}
+
+// Find the first function with the given vendor and device IDs and
+// fill in *f.  Returns 0 on success, -E_NOT_FOUND if there is none.
+int
+pci_find_device(uint16_t vendor, uint16_t device, struct PciFunc *f)
+{
+	uint16_t id[2] = { vendor, device };
+
+	return pci_scan(pci_match_device, id, f);
+}
@@ -48,6 +48,32 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
+// Requests the server has taken in but not yet answered.  Each one
+// runs on a thread of its own, so that while one waits for the disk
+// others can go ahead.  To keep the answers the same as if the
+// requests had been served one at a time, in the order they came in,
+// a job starts only once every earlier job still in the table is
+// shared with it: both READ or STAT, and of different open files.
+// Everything else has the server to itself.  The request page is
+// moved from fsreq to a page of the job's own, so the next request
+// can come in while it runs.
+#define FS_NJOBS	(2 * FS_NTHREADS)
+#define JOBVA		((uintptr_t) fsreq - FS_NJOBS * PGSIZE)
+
+struct FsJob {
+	bool j_busy;
+	bool j_started;
+	uint32_t j_seq;		// Order the request came in
+	uint32_t j_req;
+	envid_t j_whom;
+	bool j_shared;		// READ or STAT of j_fileid
+	int j_fileid;
+	union Fsipc *j_ipc;
+};
+
+static struct FsJob jobs[FS_NJOBS];
+static int njobs;
+
 void
 serve_init(void)
 {
@@ -58,6 +84,9 @@ serve_init(void)
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
+	for (i = 0; i < FS_NJOBS; i++)
+		jobs[i].j_ipc = (union Fsipc *) (JOBVA + i * PGSIZE);
+	thread_init();
 }
 
 // Allocate an open file.
@@ -293,6 +322,23 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 	return 0;
 }
 
+// Allocate disk blocks for req->req_len bytes of req->req_fileid
+// starting at req->req_offset, extending the file if necessary.
+int
+serve_allocate(envid_t envid, struct Fsreq_allocate *req)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_allocate %08x %08x %08x %08x\n", envid,
+			req->req_fileid, req->req_offset, req->req_len);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	return file_allocate(o->o_file, req->req_offset, req->req_len);
+}
+
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -311,22 +357,78 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_ALLOCATE] =	(fshandler)serve_allocate
 };
 
+static bool
+job_may_start(struct FsJob *j)
+{
+	struct FsJob *k;
+
+	for (k = jobs; k < jobs + FS_NJOBS; k++)
+		if (k->j_busy && k->j_seq < j->j_seq
+		    && !(j->j_shared && k->j_shared && j->j_fileid != k->j_fileid))
+			return 0;
+	return 1;
+}
+
+static void
+serve_job(void *arg)
+{
+	struct FsJob *j = arg;
+	int perm = PTE_P|PTE_W|PTE_U, r;
+	void *pg = NULL;
+
+	if (debug)
+		cprintf("fs req %d from %08x [page %08x: %s]\n",
+			j->j_req, j->j_whom, uvpt[PGNUM(j->j_ipc)], j->j_ipc);
+
+	if (j->j_req == FSREQ_OPEN) {
+		r = serve_open(j->j_whom, (struct Fsreq_open*)j->j_ipc, &pg, &perm);
+	} else if (j->j_req < ARRAY_SIZE(handlers) && handlers[j->j_req]) {
+		r = handlers[j->j_req](j->j_whom, j->j_ipc);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", j->j_req, j->j_whom);
+		r = -E_INVAL;
+	}
+	ipc_send(j->j_whom, r, pg, perm);
+	sys_page_unmap(0, j->j_ipc);
+	j->j_busy = 0;
+	njobs--;
+	bc_writeback();
+}
+
 void
 serve(void)
 {
+	static uint32_t seq;
 	uint32_t req, whom;
+	struct FsJob *j;
 	int perm, r;
-	void *pg;
 
 	while (1) {
+		// Start what may start, then run threads until all of them
+		// wait for the disk
+		for (j = jobs; j < jobs + FS_NJOBS; j++)
+			if (j->j_busy && !j->j_started && job_may_start(j)
+			    && thread_create(serve_job, j) == 0)
+				j->j_started = 1;
+		if (thread_schedule())
+			continue;
+		if (njobs == FS_NJOBS) {
+			thread_wait_any();
+			continue;
+		}
+
 		perm = 0;
 		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
-		if (debug)
-			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
+
+		// Device interrupts arrive as messages from the kernel
+		if (whom == 0) {
+			disk_intr(req);
+			continue;
+		}
 
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
@@ -335,17 +437,19 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
+		for (j = jobs; j->j_busy; j++)
+			/* do nothing */;
+		if ((r = sys_page_map(0, fsreq, 0, j->j_ipc, perm & PTE_SYSCALL)) < 0)
+			panic("serve: sys_page_map: %e", r);
 		sys_page_unmap(0, fsreq);
+		j->j_busy = 1;
+		j->j_started = 0;
+		j->j_seq = seq++;
+		j->j_req = req;
+		j->j_whom = whom;
+		j->j_shared = (req == FSREQ_READ || req == FSREQ_STAT);
+		j->j_fileid = j->j_ipc->read.req_fileid;
+		njobs++;
 	}
 }
 
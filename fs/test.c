@@ -5,6 +5,34 @@
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
+#define NBENCH	256
+static uint32_t benchblocks[NBENCH];
+
+// Time allocating a batch of blocks, then give them back.
+static void
+bench_alloc_block(void)
+{
+	uint64_t t0, t1;
+	int i, n, r;
+
+	t0 = read_tsc();
+	for (n = 0; n < NBENCH; n++) {
+		if ((r = alloc_block()) < 0)
+			break;
+		benchblocks[n] = r;
+	}
+	t1 = read_tsc();
+
+	for (i = 0; i < n; i++)
+		free_block(benchblocks[i]);
+	for (i = 0; i * BLKBITSIZE < super->s_nblocks; i++)
+		flush_block(diskaddr(2 + i));
+
+	if (n > 0)
+		cprintf("alloc_block: %d blocks, %u cycles per block\n",
+			n, (uint32_t) (t1 - t0) / n);
+}
+
 void
 fs_test(void)
 {
@@ -26,6 +54,7 @@ fs_test(void)
 	// and is not free any more
 	assert(!(bitmap[r/32] & (1 << (r%32))));
 	cprintf("alloc_block is good\n");
+	bench_alloc_block();
 
 	if ((r = file_open("/not-found", &f)) < 0 && r != -E_NOT_FOUND)
 		panic("file_open /not-found: %e", r);
@@ -49,13 +78,17 @@ fs_test(void)
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
-	assert(f->f_direct[0] == 0);
+	if (f->f_flags & FILE_EXTENTS)
+		assert(f->f_nextents == 0);
+	else
+		assert(f->f_direct[0] == 0);
+	// Size changes are written back lazily
+	file_flush(f);
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
@@ -64,4 +97,6 @@ fs_test(void)
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file rewrite is good\n");
+
+	bc_report();
 }
@@ -0,0 +1,156 @@
+// Cooperative threads for the file system server.  Each request the
+// server is working on runs on a thread of its own (see serve in
+// serv.c).  A thread gives up the CPU only in thread_wait_io, while
+// the disk works on a request for it, so the code between two waits
+// runs without interruption, as all of the server used to.
+
+#include "fs.h"
+
+#define THREAD_STKSIZE	(4 * PGSIZE)	// Including an unmapped guard page
+
+struct Thread {
+	uint32_t t_esp;			// Saved stack pointer, when not running
+	bool t_live;
+	struct BlkReq *t_io;		// Disk request it is waiting for
+	void (*t_fn)(void *);
+	void *t_arg;
+};
+
+static struct Thread threads[FS_NTHREADS];
+static char thread_stacks[FS_NTHREADS][THREAD_STKSIZE]
+	__attribute__((aligned(PGSIZE)));
+static struct Thread *curthread;	// NULL in the scheduler
+static uint32_t thread_sched_esp;	// The scheduler's saved stack pointer
+
+// Save the callee-saved registers on the current stack and the stack
+// pointer in *save_esp, then switch to the stack at esp and resume
+// whatever was suspended there.
+void thread_switch(uint32_t *save_esp, uint32_t esp);
+asm(".text\n"
+    ".globl thread_switch\n"
+    "thread_switch:\n"
+    "	movl 4(%esp), %eax\n"
+    "	movl 8(%esp), %edx\n"
+    "	pushl %ebp\n"
+    "	pushl %ebx\n"
+    "	pushl %esi\n"
+    "	pushl %edi\n"
+    "	movl %esp, (%eax)\n"
+    "	movl %edx, %esp\n"
+    "	popl %edi\n"
+    "	popl %esi\n"
+    "	popl %ebx\n"
+    "	popl %ebp\n"
+    "	ret\n");
+
+// Unmap the bottom page of each thread stack, so that an overflow
+// faults instead of running into the next stack.
+void
+thread_init(void)
+{
+	int i, r;
+
+	for (i = 0; i < FS_NTHREADS; i++)
+		if ((r = sys_page_unmap(0, thread_stacks[i])) < 0)
+			panic("thread_init: sys_page_unmap: %e", r);
+}
+
+static void
+thread_main(void)
+{
+	curthread->t_fn(curthread->t_arg);
+	curthread->t_live = 0;
+	thread_switch(&curthread->t_esp, thread_sched_esp);
+	panic("finished thread resumed");
+}
+
+// Start a thread running fn(arg).  It first runs at the next
+// thread_schedule.
+// Returns 0 on success, -E_NO_MEM if all threads are in use.
+int
+thread_create(void (*fn)(void *), void *arg)
+{
+	struct Thread *t;
+	uint32_t *sp;
+	int i;
+
+	for (i = 0; i < FS_NTHREADS && threads[i].t_live; i++)
+		/* do nothing */;
+	if (i == FS_NTHREADS)
+		return -E_NO_MEM;
+
+	t = &threads[i];
+	t->t_live = 1;
+	t->t_io = NULL;
+	t->t_fn = fn;
+	t->t_arg = arg;
+
+	// A frame for thread_switch to pop, returning into thread_main
+	sp = (uint32_t *) (thread_stacks[i] + THREAD_STKSIZE);
+	*--sp = 0;			// thread_main's return address
+	*--sp = (uint32_t) thread_main;
+	*--sp = 0;			// %ebp
+	*--sp = 0;			// %ebx
+	*--sp = 0;			// %esi
+	*--sp = 0;			// %edi
+	t->t_esp = (uint32_t) sp;
+	return 0;
+}
+
+// Index of the running thread, -1 in the scheduler.
+int
+thread_id(void)
+{
+	return curthread ? curthread - threads : -1;
+}
+
+// Run each thread that is not waiting for the disk until it waits or
+// finishes.  Called from the scheduler only.
+// Returns the number of threads that ran.
+int
+thread_schedule(void)
+{
+	struct Thread *t;
+	int n = 0;
+
+	assert(!curthread);
+	for (t = threads; t < threads + FS_NTHREADS; t++) {
+		if (!t->t_live || (t->t_io && !t->t_io->br_done))
+			continue;
+		t->t_io = NULL;
+		curthread = t;
+		thread_switch(&thread_sched_esp, t->t_esp);
+		curthread = NULL;
+		n++;
+	}
+	return n;
+}
+
+// Wait for submitted disk request 'req' and return its result.  On a
+// thread, with interrupt-driven I/O, other threads run meanwhile;
+// otherwise this is disk_wait.
+int
+thread_wait_io(struct BlkReq *req)
+{
+	struct Thread *t = curthread;
+
+	if (req->br_done || !t || !disk_async())
+		return disk_wait(req);
+	t->t_io = req;
+	thread_switch(&t->t_esp, thread_sched_esp);
+	return req->br_result;
+}
+
+// Block until some thread's disk request completes.  Called from the
+// scheduler when it cannot take on more work.
+void
+thread_wait_any(void)
+{
+	struct Thread *t;
+
+	for (t = threads; t < threads + FS_NTHREADS; t++)
+		if (t->t_live && t->t_io && !t->t_io->br_done) {
+			disk_wait(t->t_io);
+			return;
+		}
+}
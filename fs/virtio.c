@@ -0,0 +1,329 @@
+/*
+ * Driver for a legacy (virtio 0.9.5) virtio block device on PCI, as
+ * QEMU provides with "-drive file=...,if=virtio".  Requests go on a
+ * single virtqueue, up to VIO_NSLOTS of them in flight at once, and
+ * complete by interrupt.  See the "Virtio PCI Card Specification".
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define VIRTIO_VENDOR		0x1AF4
+#define VIRTIO_DEV_BLK		0x1001	// Legacy block device
+
+// Legacy virtio registers, relative to BAR 0 (I/O space)
+#define VIO_HOST_FEATURES	0x00
+#define VIO_GUEST_FEATURES	0x04
+#define VIO_QUEUE_PFN		0x08
+#define VIO_QUEUE_NUM		0x0C
+#define VIO_QUEUE_SEL		0x0E
+#define VIO_QUEUE_NOTIFY	0x10
+#define VIO_STATUS		0x12
+#define VIO_ISR			0x13
+#define VIO_CONFIG		0x14	// Block device: capacity in sectors
+
+#define VIO_ST_ACK		0x01
+#define VIO_ST_DRIVER		0x02
+#define VIO_ST_DRIVER_OK	0x04
+
+// Virtqueue layout, shared with the device
+struct VringDesc {
+	uint64_t vd_addr;
+	uint32_t vd_len;
+	uint16_t vd_flags;
+	uint16_t vd_next;
+};
+#define VRING_DESC_NEXT		0x1	// Chain continues at vd_next
+#define VRING_DESC_WRITE	0x2	// Device writes this buffer
+
+struct VringAvail {
+	uint16_t va_flags;
+	uint16_t va_idx;
+	uint16_t va_ring[];
+};
+
+struct VringUsed {
+	uint16_t vu_flags;
+	uint16_t vu_idx;
+	struct {
+		uint32_t id;		// Head of the completed chain
+		uint32_t len;
+	} vu_ring[];
+};
+
+// Block request header and status
+struct VirtioBlkHdr {
+	uint32_t vh_type;
+	uint32_t vh_reserved;
+	uint64_t vh_sector;
+};
+#define VIRTIO_BLK_T_IN		0
+#define VIRTIO_BLK_T_OUT	1
+#define VIRTIO_BLK_S_OK		0
+
+// Largest queue we can set up; the device picks the size
+#define VIO_MAXQ		256
+#define VIO_PGALIGN(n)		(((n) + PGSIZE - 1) & ~(PGSIZE - 1))
+#define VIO_USEDOFF(q)		VIO_PGALIGN(16 * (q) + 6 + 2 * (q))
+#define VIO_RINGSIZE(q)		(VIO_USEDOFF(q) + VIO_PGALIGN(6 + 8 * (q)))
+// Requests in flight at once
+#define VIO_NSLOTS		32
+
+// The queue must be physically contiguous; sys_page_alloc_contig
+// replaces these pages.
+static char vq_mem[VIO_RINGSIZE(VIO_MAXQ)] __attribute__((aligned(PGSIZE)));
+static struct VringDesc *vq_desc;
+static struct VringAvail *vq_avail;
+static volatile struct VringUsed *vq_used;
+static uint16_t vq_size;
+static uint16_t vq_free;		// Free descriptors, linked by vd_next
+static uint16_t vq_nfree;
+static uint16_t vq_last_used;		// vu_idx we have caught up to
+
+// Header and status of each request in flight, all in one page so
+// their physical addresses are known
+static struct {
+	struct VirtioBlkHdr hdr[VIO_NSLOTS];
+	uint8_t status[VIO_NSLOTS];
+} vio_slots __attribute__((aligned(PGSIZE)));
+static physaddr_t vio_slots_pa;
+#define VIO_SLOT_PA(p)	(vio_slots_pa + ((char *) (p) - (char *) &vio_slots))
+static struct BlkReq *vio_req[VIO_NSLOTS];	// Request in each slot
+static uint16_t vio_head[VIO_NSLOTS];		// Its descriptor chain
+
+static struct BlkReq *vio_queue;	// Waiting for a slot, FIFO
+static struct BlkReq **vio_queue_tail = &vio_queue;
+static uint16_t vio_iobase;
+static int vio_irq = -1;		// Attached IRQ, -1 to poll
+
+// Find and set up a virtio block device.
+// Returns 0 on success, < 0 if there is none or it cannot be used.
+int
+virtio_init(void)
+{
+	struct PciFunc f;
+	uint32_t bar, i;
+	uint64_t nsect;
+	physaddr_t pa;
+	int r;
+
+	if (pci_find_device(VIRTIO_VENDOR, VIRTIO_DEV_BLK, &f) < 0)
+		return -E_NOT_FOUND;
+	bar = pci_conf_read(&f, PCI_BAR(0));
+	if (!(bar & 1)) {
+		cprintf("virtio: registers not in I/O space\n");
+		return -E_INVAL;
+	}
+	pci_conf_write(&f, PCI_CMD, pci_conf_read(&f, PCI_CMD)
+		       | PCI_CMD_IO | PCI_CMD_MASTER);
+	vio_iobase = bar & 0xFFFC;
+
+	// Reset, then negotiate no optional features
+	outb(vio_iobase + VIO_STATUS, 0);
+	outb(vio_iobase + VIO_STATUS, VIO_ST_ACK);
+	outb(vio_iobase + VIO_STATUS, VIO_ST_ACK | VIO_ST_DRIVER);
+	outl(vio_iobase + VIO_GUEST_FEATURES, 0);
+
+	outw(vio_iobase + VIO_QUEUE_SEL, 0);
+	vq_size = inw(vio_iobase + VIO_QUEUE_NUM);
+	if (vq_size == 0 || vq_size > VIO_MAXQ || (vq_size & (vq_size - 1))) {
+		cprintf("virtio: unusable queue size %d\n", vq_size);
+		goto fail;
+	}
+	if ((r = sys_page_alloc_contig(vq_mem, VIO_RINGSIZE(vq_size) / PGSIZE)) < 0
+	    || (r = sys_page_paddr(vq_mem, &pa)) < 0
+	    || (r = sys_page_paddr(&vio_slots, &vio_slots_pa)) < 0) {
+		cprintf("virtio: cannot set up queue: %e\n", r);
+		goto fail;
+	}
+	vq_desc = (struct VringDesc *) vq_mem;
+	vq_avail = (struct VringAvail *) (vq_mem + 16 * vq_size);
+	vq_used = (struct VringUsed *) (vq_mem + VIO_USEDOFF(vq_size));
+	for (i = 0; i < vq_size; i++)
+		vq_desc[i].vd_next = i + 1;
+	vq_free = 0;
+	vq_nfree = vq_size;
+	outl(vio_iobase + VIO_QUEUE_PFN, pa / PGSIZE);
+
+	if ((r = sys_irq_attach(f.pf_irq)) < 0)
+		cprintf("virtio: sys_irq_attach %d: %e, polling\n", f.pf_irq, r);
+	else
+		vio_irq = f.pf_irq;
+
+	outb(vio_iobase + VIO_STATUS, VIO_ST_ACK | VIO_ST_DRIVER | VIO_ST_DRIVER_OK);
+	nsect = inl(vio_iobase + VIO_CONFIG)
+		| ((uint64_t) inl(vio_iobase + VIO_CONFIG + 4) << 32);
+	cprintf("virtio: block device at port 0x%x, irq %d, %u sectors, "
+		"queue size %d\n", vio_iobase, f.pf_irq, (uint32_t) nsect,
+		vq_size);
+	return 0;
+
+fail:
+	outb(vio_iobase + VIO_STATUS, 0);
+	return -E_INVAL;
+}
+
+// Fill in a free descriptor and return its index.
+static uint16_t
+vq_desc_alloc(physaddr_t pa, uint32_t len, uint16_t flags)
+{
+	uint16_t d = vq_free;
+
+	vq_free = vq_desc[d].vd_next;
+	vq_nfree--;
+	vq_desc[d].vd_addr = pa;
+	vq_desc[d].vd_len = len;
+	vq_desc[d].vd_flags = flags;
+	return d;
+}
+
+static void
+vq_chain_free(uint16_t d)
+{
+	uint16_t next;
+
+	while (1) {
+		next = vq_desc[d].vd_next;
+		vq_desc[d].vd_next = vq_free;
+		vq_free = d;
+		vq_nfree++;
+		if (!(vq_desc[d].vd_flags & VRING_DESC_NEXT))
+			break;
+		d = next;
+	}
+}
+
+// Build the descriptor chain for req in slot s: header, one
+// descriptor per page of the buffer, status.
+// Returns the head, or -E_INVAL if the buffer is not mapped.
+static int
+virtio_chain(struct BlkReq *req, int s)
+{
+	uintptr_t va = (uintptr_t) req->br_buf;
+	size_t len = req->br_nsecs * SECTSIZE, n;
+	uint16_t head, d, flags;
+	physaddr_t pa;
+
+	vio_slots.hdr[s].vh_type = req->br_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	vio_slots.hdr[s].vh_reserved = 0;
+	vio_slots.hdr[s].vh_sector = req->br_secno;
+	vio_slots.status[s] = 0xFF;
+
+	head = d = vq_desc_alloc(VIO_SLOT_PA(&vio_slots.hdr[s]),
+				 sizeof(struct VirtioBlkHdr), VRING_DESC_NEXT);
+	flags = VRING_DESC_NEXT | (req->br_write ? 0 : VRING_DESC_WRITE);
+	for (; len > 0; va += n, len -= n) {
+		n = MIN(len, PGSIZE - PGOFF(va));
+		if (sys_page_paddr((void *) va, &pa) < 0) {
+			vq_desc[d].vd_flags = 0;
+			vq_chain_free(head);
+			return -E_INVAL;
+		}
+		d = vq_desc[d].vd_next = vq_desc_alloc(pa, n, flags);
+	}
+	vq_desc[d].vd_next = vq_desc_alloc(VIO_SLOT_PA(&vio_slots.status[s]),
+					   1, VRING_DESC_WRITE);
+	return head;
+}
+
+// Move queued requests into free slots and tell the device.
+static void
+virtio_kick(void)
+{
+	struct BlkReq *req;
+	bool added = 0;
+	size_t need;
+	int s, head;
+
+	while ((req = vio_queue)) {
+		need = 2 + (PGOFF(req->br_buf) + req->br_nsecs * SECTSIZE
+			    + PGSIZE - 1) / PGSIZE;
+		for (s = 0; s < VIO_NSLOTS && vio_req[s]; s++)
+			/* do nothing */;
+		if (s == VIO_NSLOTS || need > vq_nfree)
+			break;
+
+		if (!(vio_queue = req->br_next))
+			vio_queue_tail = &vio_queue;
+		if ((head = virtio_chain(req, s)) < 0) {
+			req->br_result = head;
+			req->br_done = 1;
+			continue;
+		}
+		vio_req[s] = req;
+		vio_head[s] = head;
+		vq_avail->va_ring[vq_avail->va_idx % vq_size] = head;
+		__sync_synchronize();
+		vq_avail->va_idx++;
+		added = 1;
+	}
+	if (added) {
+		__sync_synchronize();
+		outw(vio_iobase + VIO_QUEUE_NOTIFY, 0);
+	}
+}
+
+// Queue a transfer.  Its buffer must stay put until virtio_wait
+// returns.
+void
+virtio_submit(struct BlkReq *req)
+{
+	req->br_done = 0;
+	if (req->br_nsecs == 0 || req->br_nsecs > 256) {
+		req->br_result = -E_INVAL;
+		req->br_done = 1;
+		return;
+	}
+	req->br_next = NULL;
+	*vio_queue_tail = req;
+	vio_queue_tail = &req->br_next;
+	virtio_kick();
+}
+
+// Complete every request the device has finished, and start more.
+// Called on the device's interrupt, and harmless at any other time.
+void
+virtio_intr(void)
+{
+	uint16_t id;
+	int s;
+
+	// Reading the ISR acknowledges the interrupt
+	inb(vio_iobase + VIO_ISR);
+	while (vq_last_used != vq_used->vu_idx) {
+		__sync_synchronize();
+		id = vq_used->vu_ring[vq_last_used % vq_size].id;
+		vq_last_used++;
+		for (s = 0; s < VIO_NSLOTS; s++)
+			if (vio_req[s] && vio_head[s] == id)
+				break;
+		if (s == VIO_NSLOTS)
+			panic("virtio: completion for unknown descriptor %d", id);
+		vio_req[s]->br_result =
+			vio_slots.status[s] == VIRTIO_BLK_S_OK ? 0 : -1;
+		vio_req[s]->br_done = 1;
+		vio_req[s] = NULL;
+		vq_chain_free(id);
+	}
+	virtio_kick();
+}
+
+// Do requests complete by interrupt?
+bool
+virtio_async(void)
+{
+	return vio_irq >= 0;
+}
+
+// Wait for a submitted request to complete and return its result:
+// 0 on success, < 0 on error.
+int
+virtio_wait(struct BlkReq *req)
+{
+	while (!req->br_done) {
+		if (vio_irq >= 0 && vq_last_used == vq_used->vu_idx)
+			sys_irq_wait(vio_irq);
+		virtio_intr();
+	}
+	return req->br_result;
+}
@@ -26,19 +26,50 @@
 
 #define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
 
+// A run of e_len file blocks starting at file block e_fileblk,
+// stored in consecutive disk blocks starting at e_diskblk.
+struct Extent {
+	uint32_t e_fileblk;
+	uint32_t e_diskblk;
+	uint32_t e_len;
+} __attribute__((packed));
+
+// Number of extents held in a File descriptor
+#define NEXTENT		8
+// Number of extents in an extent index block
+#define NIDXEXTENT	(BLKSIZE / sizeof(struct Extent))
+#define MAXEXTENT	(NEXTENT + NIDXEXTENT)
+
+// Maximum size of an extent-mapped file
+#define MAXEXTFILESIZE	0x40000000
+
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	union {
+		// Block pointers.
+		// A block is allocated iff its value is != 0.
+		struct {
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+		};
+		// Extents, sorted by e_fileblk, when FILE_EXTENTS is set.
+		// Extents past the first NEXTENT live in the index block.
+		struct {
+			struct Extent f_extents[NEXTENT];
+			uint32_t f_nextents;		// extents in use
+			uint32_t f_extindex;		// extent index block
+		};
+	};
+
+	uint32_t f_dirindex;		// Hash index block, if FILE_DIRHASH
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 12*NEXTENT - 8 - 4 - 4];
+	uint32_t f_flags;		// FILE_* flags
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -48,6 +79,44 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// File flags
+#define FILE_EXTENTS	0x1	// Blocks are mapped by f_extents, not f_direct
+#define FILE_DIRHASH	0x2	// Directory has a hash index at f_dirindex
+
+// Hashed directories.  The entries of a directory stay a plain array
+// of struct File, but a directory with FILE_DIRHASH also indexes them
+// by name hash, in blocks outside the directory data.  Block
+// f_dirindex holds a DirIndex whose table maps the low di_depth bits
+// of a hash to the DirBucket listing those entries (extendible
+// hashing); entries never move when a bucket splits.
+#define DIRHASH_MAXDEPTH	9
+#define DIRBUCKET_NENTS		((BLKSIZE - 8) / 8)
+
+struct DirIndex {
+	uint32_t di_depth;		// Hash bits used to pick a bucket
+	uint32_t di_bucket[1 << DIRHASH_MAXDEPTH];
+};
+
+struct DirBucket {
+	uint32_t db_depth;		// Hash bits all entries here share
+	uint32_t db_n;			// Entries in use
+	struct {
+		uint32_t de_hash;	// dir_hash of the entry's name
+		uint32_t de_slot;	// Index of the entry in the directory
+	} db_ents[DIRBUCKET_NENTS];
+};
+
+// FNV-1a hash of a file name
+static inline uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
 
 // File system super-block (both in-memory and on-disk)
 
@@ -57,6 +126,39 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_journal;		// First journal block, 0 if none
+	uint32_t s_njournal;		// Number of journal blocks
+};
+
+// Metadata journal.  The first journal block holds a JournalHeader,
+// followed by copies of the jh_n blocks it lists.  A transaction is
+// written in one go and counts as committed if its checksum matches.
+#define JOURNAL_MAGIC	0x4C4E524A	// 'JRNL'
+#define JOURNAL_NBLOCKS	64		// Header and block copies
+
+struct JournalHeader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC
+	uint32_t jh_seq;		// Transaction number
+	uint32_t jh_n;			// Blocks in this transaction
+	uint32_t jh_sum;		// journal_sum of the rest
+	uint32_t jh_blockno[JOURNAL_NBLOCKS - 1];	// Home locations
+};
+
+// Striped (RAID-0) volumes.  A file system can be spread over IDE
+// disks 0 and 1, alternating between them every sl_stripe sectors.
+// Each member begins with a block holding a StripeLabel, followed by
+// its share of the volume.  Disk 1's member begins at sector 0, where
+// a plain file system has its unused boot block; disk 0's begins
+// after the boot image.
+#define STRIPE_MAGIC	0x44494152	// 'RAID'
+#define STRIPE_NMEMBERS	2
+
+struct StripeLabel {
+	uint32_t sl_magic;		// STRIPE_MAGIC
+	uint32_t sl_member;		// Index of this member (its IDE disk)
+	uint32_t sl_stripe;		// Sectors per stripe unit
+	uint32_t sl_nsect;		// Volume sectors on each member
+	uint32_t sl_start[STRIPE_NMEMBERS];	// Sector of each member's label
 };
 
 // Definitions for requests from clients to file system
@@ -70,7 +172,8 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	FSREQ_ALLOCATE
 };
 
 union Fsipc {
@@ -108,6 +211,11 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_allocate {
+		int req_fileid;
+		off_t req_offset;
+		off_t req_len;
+	} allocate;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
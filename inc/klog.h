@@ -0,0 +1,21 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_KLOG_H
+#define JOS_INC_KLOG_H
+
+#include <inc/types.h>
+
+// The kernel keeps the last KLOG_NRECORDS lines of console output.
+// Lines longer than KLOG_LINELEN are split over several records.
+#define KLOG_NRECORDS	256
+#define KLOG_LINELEN	80
+
+struct KlogRecord {
+	uint64_t kr_tsc;	// Time stamp counter at the start of the line
+	uint32_t kr_seq;	// Sequence number, counting from boot
+	uint16_t kr_cpu;	// CPU that printed the line
+	uint16_t kr_len;	// Length of kr_text; not NUL-terminated
+	char kr_text[KLOG_LINELEN];
+};
+
+#endif /* !JOS_INC_KLOG_H */
@@ -20,6 +20,8 @@
 #include <inc/fs.h>
 #include <inc/fd.h>
 #include <inc/args.h>
+#include <inc/trace.h>
+#include <inc/klog.h>
 
 #define USED(x)		(void)(x)
 
@@ -44,6 +46,7 @@ char*	readline(const char *buf);
 // syscall.c
 void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
+int	sys_cons_read(void *buf, size_t n);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
@@ -57,6 +60,13 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_trace_read(int cpu, uint32_t seq, struct TraceEvent *buf, size_t n);
+int	sys_klog_read(uint32_t seq, struct KlogRecord *buf, size_t n);
+int	sys_klog_wait(uint32_t seq);
+int	sys_page_paddr(void *va, physaddr_t *pa);
+int	sys_irq_attach(int irq);
+int	sys_irq_wait(int irq);
+int	sys_page_alloc_contig(void *va, size_t npages);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -93,6 +103,7 @@ int	stat(const char *path, struct Stat *statbuf);
 // file.c
 int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
+int	fallocate(int fd, off_t offset, off_t len);
 int	remove(const char *path);
 int	sync(void);
 
@@ -17,6 +17,14 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_trace_read,
+	SYS_klog_read,
+	SYS_klog_wait,
+	SYS_cons_read,
+	SYS_page_paddr,
+	SYS_irq_attach,
+	SYS_irq_wait,
+	SYS_page_alloc_contig,
 	NSYSCALLS
 };
 
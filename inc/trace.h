@@ -0,0 +1,39 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_TRACE_H
+#define JOS_INC_TRACE_H
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// Kernel tracepoints.  Each kind of event can be turned on and off
+// separately; see the monitor's 'trace' command.
+enum {
+	TRACE_ENV_RUN = 0,	// arg0: env being switched to
+	TRACE_SCHED_YIELD,	// (no arguments)
+	TRACE_SYSCALL,		// arg0: syscall number, arg1-2: first arguments
+	TRACE_PGFAULT,		// arg0: fault va, arg1: eip, arg2: error code
+	TRACE_PAGE_ALLOC,	// arg0: physical address, arg1: alloc flags
+	TRACE_PAGE_FREE,	// arg0: physical address
+	TRACE_IPC_SEND,		// arg0: target env, arg1: value, arg2: srcva
+	TRACE_IPC_RECV,		// arg0: dstva
+	TRACE_IRQ,		// arg0: IRQ number, arg1: interrupted eip
+	NTRACE
+};
+
+// Number of events each CPU keeps; older events are overwritten
+#define TRACE_NEVENTS	1024
+
+// One recorded event.  te_seq counts the events recorded on te_cpu,
+// so a reader can tell where it left off and whether it fell behind.
+struct TraceEvent {
+	uint64_t te_tsc;	// Time stamp counter when recorded
+	uint32_t te_seq;	// Per-CPU sequence number
+	envid_t te_env;		// Current environment, 0 if none
+	uint8_t te_cpu;
+	uint8_t te_type;	// One of TRACE_*
+	uint16_t te_pad;
+	uint32_t te_arg[3];
+};
+
+#endif /* !JOS_INC_TRACE_H */
@@ -39,6 +39,9 @@
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
 
+// Byte offset of tf_cs in struct Trapframe, for kern/trapentry.S
+#define TF_CS		0x34
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
@@ -5,12 +5,16 @@
 #include <inc/kbdreg.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/irq.h>
+#include <kern/env.h>
 
 static void cons_intr(int (*proc)(void));
+static void cons_wakeup(void *arg);
 static void cons_putc(int c);
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
@@ -33,8 +37,13 @@ delay(void)
 #define COM_DLM		1	// Out: Divisor Latch High (DLAB=1)
 #define COM_IER		1	// Out: Interrupt Enable Register
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
+#define   COM_IER_TXI	0x02	//   Enable transmitter empty interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
+#define   COM_IIR_FIFO	0xC0	//   FIFOs enabled
 #define COM_FCR		2	// Out: FIFO Control Register
+#define   COM_FCR_ENABLE	0x01	//   Enable FIFOs
+#define   COM_FCR_RXCLR	0x02	//   Clear receive FIFO
+#define   COM_FCR_TXCLR	0x04	//   Clear transmit FIFO
 #define COM_LCR		3	// Out: Line Control Register
 #define	  COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	  COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -48,6 +57,21 @@ delay(void)
 #define   COM_LSR_TSRE	0x40	//   Transmitter off
 
 static bool serial_exists;
+static int serial_fifosize;	// Bytes we may write once TXRDY is set
+
+// Characters waiting to be sent.  The THRE interrupt moves them into
+// the UART, so cprintf does not wait for the line.  Like the rest of
+// the console, this is protected by the big kernel lock.
+#define SERIAL_TXBUFSIZE 4096
+
+static struct {
+	uint8_t buf[SERIAL_TXBUFSIZE];
+	uint32_t rpos;
+	uint32_t wpos;
+} serial_tx;
+static bool serial_txi;		// THRE interrupt enabled
+
+static void serial_tx_start(void);
 
 static int
 serial_proc_data(void)
@@ -65,7 +89,44 @@ serial_intr(void)
 }
 
 static void
-serial_putc(int c)
+serial_tx_defer(void *arg)
+{
+	serial_tx_start();
+}
+
+// Take the received characters now; refilling the transmit FIFO can
+// wait until we leave the kernel.
+static void
+serial_irq(struct Trapframe *tf)
+{
+	serial_intr();
+	irq_defer(serial_tx_defer, NULL);
+}
+
+// Fill the transmit FIFO from serial_tx if the UART has drained it.
+// Never waits.  While characters remain queued, the THRE interrupt
+// stays enabled to call us again, including when the FIFO is still
+// busy with earlier characters.
+static void
+serial_tx_start(void)
+{
+	bool txi;
+	int i;
+
+	if (inb(COM1 + COM_LSR) & COM_LSR_TXRDY)
+		for (i = 0; i < serial_fifosize && serial_tx.rpos != serial_tx.wpos; i++)
+			outb(COM1 + COM_TX, serial_tx.buf[serial_tx.rpos++ % SERIAL_TXBUFSIZE]);
+
+	txi = serial_tx.rpos != serial_tx.wpos;
+	if (txi != serial_txi) {
+		outb(COM1 + COM_IER, COM_IER_RDI | (txi ? COM_IER_TXI : 0));
+		serial_txi = txi;
+	}
+}
+
+// Wait until the UART can take more characters, or give up.
+static void
+serial_tx_wait(void)
 {
 	int i;
 
@@ -73,15 +134,47 @@ serial_putc(int c)
 	     !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
 	     i++)
 		delay();
+}
+
+static void
+serial_putc(int c)
+{
+	extern const char *panicstr;
+
+	if (!serial_exists)
+		return;
+
+	// After a panic interrupts may never come again; write everything
+	// out before returning.
+	if (panicstr) {
+		while (serial_tx.rpos != serial_tx.wpos) {
+			serial_tx_wait();
+			outb(COM1 + COM_TX, serial_tx.buf[serial_tx.rpos++ % SERIAL_TXBUFSIZE]);
+		}
+		serial_tx_wait();
+		outb(COM1 + COM_TX, c);
+		return;
+	}
 
-	outb(COM1 + COM_TX, c);
+	// If the queue is full, wait for room; drop the oldest
+	// character if the UART is stuck.
+	if (serial_tx.wpos - serial_tx.rpos == SERIAL_TXBUFSIZE) {
+		serial_tx_wait();
+		serial_tx_start();
+		if (serial_tx.wpos - serial_tx.rpos == SERIAL_TXBUFSIZE)
+			serial_tx.rpos++;
+	}
+	serial_tx.buf[serial_tx.wpos++ % SERIAL_TXBUFSIZE] = c;
+	serial_tx_start();
 }
 
 static void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1+COM_FCR, 0);
+	// Turn on and clear the FIFOs; a 16550 then takes 16 bytes
+	// per THRE interrupt.
+	outb(COM1+COM_FCR, COM_FCR_ENABLE | COM_FCR_RXCLR | COM_FCR_TXCLR);
+	serial_fifosize = (inb(COM1+COM_IIR) & COM_IIR_FIFO) == COM_IIR_FIFO ? 16 : 1;
 
 	// Set speed; requires DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_DLAB);
@@ -103,8 +196,10 @@ serial_init(void)
 	(void) inb(COM1+COM_RX);
 
 	// Enable serial interrupts
-	if (serial_exists)
+	if (serial_exists) {
+		irq_register(IRQ_SERIAL, serial_irq);
 		irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_SERIAL));
+	}
 }
 
 
@@ -375,11 +470,18 @@ kbd_intr(void)
 	cons_intr(kbd_proc_data);
 }
 
+static void
+kbd_irq(struct Trapframe *tf)
+{
+	kbd_intr();
+}
+
 static void
 kbd_init(void)
 {
 	// Drain the kbd buffer so that QEMU generates interrupts.
 	kbd_intr();
+	irq_register(IRQ_KBD, kbd_irq);
 	irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_KBD));
 }
 
@@ -398,11 +500,17 @@ static struct {
 	uint32_t wpos;
 } cons;
 
+// Environments blocked in sys_cons_read.  Each env has the slot
+// ENVX(envid), 0 if it is not waiting, so the table cannot fill up.
+static envid_t cons_waiters[NENV];
+static int cons_nwaiters;
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
 cons_intr(int (*proc)(void))
 {
+	bool got = 0;
 	int c;
 
 	while ((c = (*proc)()) != -1) {
@@ -411,7 +519,12 @@ cons_intr(int (*proc)(void))
 		cons.buf[cons.wpos++] = c;
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
+		got = 1;
 	}
+	// Waking the readers means a walk over the env table; leave it
+	// to the way out of the kernel.
+	if (got && cons_nwaiters > 0)
+		irq_defer(cons_wakeup, NULL);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -422,9 +535,12 @@ cons_getc(void)
 
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
-	// (e.g., when called from the kernel monitor).
+	// (e.g., when called from the kernel monitor).  Likewise keep
+	// queued serial output moving.
 	serial_intr();
 	kbd_intr();
+	if (serial_exists)
+		serial_tx_start();
 
 	// grab the next character from the input buffer.
 	if (cons.rpos != cons.wpos) {
@@ -436,6 +552,76 @@ cons_getc(void)
 	return 0;
 }
 
+// Read up to n characters of console input into buf without waiting.
+// A ^D is returned on its own, so that it reads as end of file.
+// Returns the number of characters read.
+int
+cons_read(char *buf, size_t n)
+{
+	int i;
+
+	serial_intr();
+	kbd_intr();
+
+	for (i = 0; i < n && cons.rpos != cons.wpos; i++) {
+		if (cons.buf[cons.rpos] == 0x04 && i > 0)
+			break;
+		buf[i] = cons.buf[cons.rpos++];
+		if (cons.rpos == CONSBUFSIZE)
+			cons.rpos = 0;
+		if (buf[i] == 0x04)
+			return 1;
+	}
+	return i;
+}
+
+// Make env 'envid' runnable again when console input arrives.
+// The caller marks it not runnable.
+void
+cons_wait(envid_t envid)
+{
+	if (cons_waiters[ENVX(envid)] == envid)
+		return;
+	if (cons_waiters[ENVX(envid)] == 0)
+		cons_nwaiters++;
+	cons_waiters[ENVX(envid)] = envid;
+}
+
+// Forget env 'envid' if it is waiting for input.  Called when it is
+// freed.
+void
+cons_unwait(envid_t envid)
+{
+	if (cons_waiters[ENVX(envid)] != envid)
+		return;
+	cons_waiters[ENVX(envid)] = 0;
+	cons_nwaiters--;
+}
+
+// Is any env waiting for console input?
+bool
+cons_waiting(void)
+{
+	return cons_nwaiters > 0;
+}
+
+static void
+cons_wakeup(void *arg)
+{
+	struct Env *e;
+	int i;
+
+	for (i = 0; i < NENV && cons_nwaiters > 0; i++) {
+		if (cons_waiters[i] == 0)
+			continue;
+		if (envid2env(cons_waiters[i], &e, 0) == 0
+		    && e->env_status == ENV_NOT_RUNNABLE)
+			e->env_status = ENV_RUNNABLE;
+		cons_waiters[i] = 0;
+		cons_nwaiters--;
+	}
+}
+
 // output a character to the console
 static void
 cons_putc(int c)
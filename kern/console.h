@@ -7,6 +7,7 @@
 #endif
 
 #include <inc/types.h>
+#include <inc/env.h>
 
 #define MONO_BASE	0x3B4
 #define MONO_BUF	0xB0000
@@ -19,6 +20,10 @@
 
 void cons_init(void);
 int cons_getc(void);
+int cons_read(char *buf, size_t n);
+void cons_wait(envid_t envid);
+void cons_unwait(envid_t envid);
+bool cons_waiting(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
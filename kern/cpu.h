@@ -34,12 +34,16 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
+// Virtual address of the top of CPU i's kernel stack.
+// kern/trapentry.S open-codes the same computation.
+#define percpu_kstacktop(i)	(KSTACKTOP - (i) * (KSTKSIZE + KSTKGAP))
+
 int cpunum(void);
 #define thiscpu (&cpus[cpunum()])
 
 void mp_init(void);
 void lapic_init(void);
-void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_startaps(uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
 
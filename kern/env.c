@@ -14,6 +14,10 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/irq.h>
+#include <kern/console.h>
+#include <kern/klog.h>
+#include <kern/trace.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -404,6 +408,11 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Forget any console input or IRQs it was waiting for
+	cons_unwait(e->env_id);
+	klog_unwait(e->env_id);
+	irq_detach(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -512,6 +521,12 @@ env_run(struct Env *e)
 	// LAB 3: Your code here.
 	// cprintf("curenv: %x, e: %x\n", curenv, e);
 	// cprintf("\n");
+
+	// Finish the bottom halves of interrupts this CPU took
+	// before leaving the kernel.
+	irq_run_deferred();
+
+	TRACE(TRACE_ENV_RUN, e->env_id, 0, 0);
 	if (curenv != NULL && curenv->env_status == ENV_RUNNING)
 		curenv->env_status = ENV_RUNNABLE;
 	curenv = e;
@@ -519,6 +534,10 @@ env_run(struct Env *e)
 	curenv->env_runs++;
 	lcr3(PADDR(curenv->env_pgdir));
 
+	// Have the next trap from user mode save its frame straight
+	// into e->env_tf rather than onto the kernel stack.
+	thiscpu->cpu_ts.ts_esp0 = (uintptr_t) (&e->env_tf + 1);
+
 	unlock_kernel();
 	env_pop_tf(&curenv->env_tf);
 }
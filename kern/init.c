@@ -12,6 +12,7 @@
 #include <kern/trap.h>
 #include <kern/sched.h>
 #include <kern/picirq.h>
+#include <kern/ioapic.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 
@@ -40,6 +41,7 @@ i386_init(void)
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
+	ioapic_init();
 
 	// Acquire the big kernel lock before waking up APs
 	// Your code here:
@@ -48,6 +50,10 @@ i386_init(void)
 	// Starting non-boot CPUs
 	boot_aps();
 
+	// Now that every CPU can take interrupts, spread the device
+	// IRQs across them.
+	ioapic_balance();
+
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -69,11 +75,6 @@ i386_init(void)
 	sched_yield();
 }
 
-// While boot_aps is booting a given CPU, it communicates the per-core
-// stack pointer that should be loaded by mpentry.S to that CPU in
-// this variable.
-void *mpentry_kstack;
-
 // Start the non-boot (AP) processors.
 static void
 boot_aps(void)
@@ -82,22 +83,26 @@ boot_aps(void)
 	void *code;
 	struct CpuInfo *c;
 
+	if (ncpu == 1)
+		return;
+
 	// Write entry code to unused memory at MPENTRY_PADDR
 	code = KADDR(MPENTRY_PADDR);
 	memmove(code, mpentry_start, mpentry_end - mpentry_start);
 
-	// Boot each AP one at a time
+	// Start all APs at mpentry_start at once.  Each finds its own
+	// stack in mpentry.S.
+	lapic_startaps(PADDR(code));
+
+	// Wait for each CPU to finish some basic setup in mp_main().
+	// The APs run concurrently and do not hold the kernel lock yet,
+	// so we print for them.
 	for (c = cpus; c < cpus + ncpu; c++) {
 		if (c == cpus + cpunum())  // We've started already.
 			continue;
-
-		// Tell mpentry.S what stack to use 
-		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
-		// Start the CPU at mpentry_start
-		lapic_startap(c->cpu_id, PADDR(code));
-		// Wait for the CPU to finish some basic setup in mp_main()
 		while(c->cpu_status != CPU_STARTED)
 			;
+		cprintf("SMP: CPU %d starting\n", c - cpus);
 	}
 }
 
@@ -107,7 +112,6 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(PADDR(kern_pgdir));
-	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
 	env_init_percpu();
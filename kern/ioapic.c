@@ -0,0 +1,186 @@
+// The I/O APIC routes device interrupts to the local APICs.
+// See the Intel 82093AA I/O APIC datasheet and [MP 3.6.8, 4.3.4].
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/trap.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+#include <kern/ioapic.h>
+
+// I/O APIC registers, accessed indirectly through IOREGSEL/IOWIN.
+#define REG_ID		0x00	// Identification
+#define REG_VER		0x01	// Version; bits 16-23 hold the last pin
+#define REG_TABLE	0x10	// Redirection table, two registers per pin
+
+// Redirection table entry, low word.
+#define INT_DISABLED	0x00010000	// Interrupt masked
+#define INT_LEVEL	0x00008000	// Level-triggered (vs edge)
+#define INT_ACTIVELOW	0x00002000	// Active low (vs high)
+#define INT_LOGICAL	0x00000800	// Logical destination (vs physical)
+
+struct ioapic {
+	uint32_t reg;		// IOREGSEL
+	uint32_t pad[3];
+	uint32_t data;		// IOWIN
+};
+
+physaddr_t ioapicaddr;		// Initialized in mpconfig.c
+uint8_t ioapicid;
+struct IrqRoute irq_routes[MAX_IRQS];
+
+bool ioapic_inuse;
+static volatile struct ioapic *ioapic;
+static int ioapic_maxpin;
+static uint16_t ioapic_mask;	// ISA IRQs whose pins are masked
+
+static uint32_t
+ioapic_read(int reg)
+{
+	ioapic->reg = reg;
+	return ioapic->data;
+}
+
+static void
+ioapic_write(int reg, uint32_t data)
+{
+	ioapic->reg = reg;
+	ioapic->data = data;
+}
+
+// Write the redirection entry for ISA IRQ 'irq' from irq_routes[]
+// and the current IRQ mask.
+static void
+ioapic_program(int irq)
+{
+	struct IrqRoute *r = &irq_routes[irq];
+	uint32_t lo;
+
+	lo = IRQ_OFFSET + irq;
+	if ((r->ir_flags & MPINTR_POMASK) == MPINTR_POLOW)
+		lo |= INT_ACTIVELOW;
+	if ((r->ir_flags & MPINTR_ELMASK) == MPINTR_ELLEVEL)
+		lo |= INT_LEVEL;
+	if (irq_mask_8259A & (1 << irq)) {
+		lo |= INT_DISABLED;
+		ioapic_mask |= 1 << irq;
+	} else
+		ioapic_mask &= ~(1 << irq);
+
+	// Mask the pin while the destination changes.
+	ioapic_write(REG_TABLE + 2 * r->ir_pin, INT_DISABLED);
+	ioapic_write(REG_TABLE + 2 * r->ir_pin + 1,
+		     cpus[r->ir_cpu].cpu_id << 24);
+	ioapic_write(REG_TABLE + 2 * r->ir_pin, lo);
+}
+
+void
+ioapic_init(void)
+{
+	int i;
+
+	if (!ioapicaddr)
+		return;
+
+	ioapic = mmio_map_region(ioapicaddr, PGSIZE);
+	ioapic_maxpin = (ioapic_read(REG_VER) >> 16) & 0xFF;
+	if (((ioapic_read(REG_ID) >> 24) & 0x0F) != (ioapicid & 0x0F))
+		cprintf("IOAPIC: ID %d does not match MP table ID %d\n",
+			ioapic_read(REG_ID) >> 24, ioapicid);
+
+	// Mask every pin; ISA IRQs are re-enabled below.
+	for (i = 0; i <= ioapic_maxpin; i++) {
+		ioapic_write(REG_TABLE + 2 * i, INT_DISABLED);
+		ioapic_write(REG_TABLE + 2 * i + 1, 0);
+	}
+
+	// ISA IRQs the MP table did not mention are identity-mapped
+	// and edge-triggered, active high [MP 5.3].
+	for (i = 0; i < MAX_IRQS; i++) {
+		if (!irq_routes[i].ir_mp) {
+			irq_routes[i].ir_pin = i;
+			irq_routes[i].ir_flags = 0;
+		}
+		if (irq_routes[i].ir_pin > ioapic_maxpin)
+			irq_routes[i].ir_pin = i;
+		irq_routes[i].ir_cpu = bootcpu - cpus;
+	}
+
+	// From here on the 8259A stays fully masked and the I/O APIC
+	// delivers device interrupts.
+	outb(IO_PIC1+1, 0xFF);
+	outb(IO_PIC2+1, 0xFF);
+	ioapic_inuse = 1;
+	for (i = 0; i < MAX_IRQS; i++)
+		if (i != IRQ_SLAVE)
+			ioapic_program(i);
+
+	cprintf("IOAPIC: %d pins at 0x%08x\n", ioapic_maxpin + 1, ioapicaddr);
+	irq_setmask_8259A(irq_mask_8259A);
+}
+
+// Bring the pins in line with irq_mask_8259A after it changes, by
+// flipping the mask bit of just the pins whose IRQ changed; the rest
+// keep delivering undisturbed.  Called from irq_setmask_quiet, once or
+// twice per interrupt for IRQs user environments own.
+void
+ioapic_setmask(void)
+{
+	uint16_t changed = (irq_mask_8259A ^ ioapic_mask) & ~(1 << IRQ_SLAVE);
+	uint32_t reg, lo;
+	int i;
+
+	for (i = 0; i < MAX_IRQS; i++) {
+		if (!(changed & (1 << i)))
+			continue;
+		reg = REG_TABLE + 2 * irq_routes[i].ir_pin;
+		lo = ioapic_read(reg);
+		if (irq_mask_8259A & (1 << i))
+			lo |= INT_DISABLED;
+		else
+			lo &= ~INT_DISABLED;
+		ioapic_write(reg, lo);
+	}
+	ioapic_mask ^= changed;
+}
+
+// Deliver 'irq' to CPU index 'cpu' from now on.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if irq or cpu is out of range, cpu has not started,
+//		or the I/O APIC is not in use.
+int
+ioapic_set_affinity(int irq, int cpu)
+{
+	if (!ioapic_inuse || irq < 0 || irq >= MAX_IRQS || irq == IRQ_SLAVE)
+		return -E_INVAL;
+	if (cpu < 0 || cpu >= ncpu || cpus[cpu].cpu_status == CPU_UNUSED)
+		return -E_INVAL;
+
+	irq_routes[irq].ir_cpu = cpu;
+	ioapic_program(irq);
+	return 0;
+}
+
+// Spread the enabled IRQs round-robin over the running CPUs.
+void
+ioapic_balance(void)
+{
+	int irq, cpu = 0;
+
+	if (!ioapic_inuse)
+		return;
+
+	for (irq = 0; irq < MAX_IRQS; irq++) {
+		if (irq == IRQ_SLAVE || (irq_mask_8259A & (1 << irq)))
+			continue;
+		while (cpus[cpu].cpu_status == CPU_UNUSED)
+			cpu = (cpu + 1) % ncpu;
+		ioapic_set_affinity(irq, cpu);
+		cpu = (cpu + 1) % ncpu;
+	}
+}
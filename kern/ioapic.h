@@ -0,0 +1,38 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IOAPIC_H
+#define JOS_KERN_IOAPIC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/picirq.h>
+
+// MP interrupt entry flags [MP 4.3.4]
+#define MPINTR_POMASK	0x03	// Polarity
+#define   MPINTR_POLOW	0x03	//   Active low
+#define MPINTR_ELMASK	0x0C	// Trigger mode
+#define   MPINTR_ELLEVEL 0x0C	//   Level triggered
+
+// How one ISA IRQ reaches the CPUs through the I/O APIC.
+struct IrqRoute {
+	bool ir_mp;		// Set when the MP table described this IRQ
+	uint8_t ir_pin;		// I/O APIC input pin
+	uint16_t ir_flags;	// MPINTR_* polarity and trigger flags
+	uint8_t ir_cpu;		// Index into cpus[] of the target CPU
+};
+
+// Initialized in mpconfig.c
+extern physaddr_t ioapicaddr;	// Physical MMIO address of the I/O APIC
+extern uint8_t ioapicid;	// I/O APIC ID from the MP table
+extern struct IrqRoute irq_routes[MAX_IRQS];
+
+extern bool ioapic_inuse;	// IRQs are delivered by the I/O APIC
+
+void ioapic_init(void);
+void ioapic_setmask(void);
+int ioapic_set_affinity(int irq, int cpu);
+void ioapic_balance(void);
+
+#endif	// !JOS_KERN_IOAPIC_H
@@ -0,0 +1,244 @@
+// IRQ handler registration, delivery of IRQs to user-level drivers,
+// and per-CPU deferred work ("bottom halves").
+
+#include <inc/types.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/irq.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/trace.h>
+
+static irq_handler_t irq_handlers[MAX_IRQS];
+
+// IRQs delivered to user environments (device drivers such as the
+// file system server).  Each interrupt wakes the owner from
+// sys_irq_wait or, if it is blocked in sys_ipc_recv instead, arrives
+// as an IPC from envid 0 whose value is the IRQ number.  An interrupt
+// that finds the owner doing neither stays pending until it waits.
+// The IRQ stays masked from each interrupt until the owner next waits,
+// by which time it has quieted the device: PCI interrupts are level
+// triggered and would otherwise keep coming.
+static struct {
+	envid_t ie_owner;
+	bool ie_pending;
+	bool ie_waiting;	// Owner is blocked in sys_irq_wait
+} irq_envs[MAX_IRQS];
+
+struct DeferredWork {
+	void (*dw_fn)(void *);
+	void *dw_arg;
+};
+
+// Each CPU queues work raised by the interrupts it takes.  All access
+// happens with the big kernel lock held, which is what lets an idle
+// CPU drain another CPU's queue.
+static struct {
+	struct DeferredWork q[NDEFERRED];
+	uint32_t rpos;
+	uint32_t wpos;
+} workq[NCPU];
+
+// Install 'handler' for hardware IRQ 'irq', replacing any previous one.
+// Returns 0 on success, -E_INVAL if irq is out of range.
+int
+irq_register(int irq, irq_handler_t handler)
+{
+	if (irq < 0 || irq >= MAX_IRQS)
+		return -E_INVAL;
+	irq_handlers[irq] = handler;
+	return 0;
+}
+
+// Run the registered handler for the interrupt in tf.
+// Returns 1 if there was one, 0 if the trap is not a handled IRQ.
+// The interrupt is acknowledged at the local APIC, and at the slave
+// 8259A for IRQs 8-15, before the handler runs (handlers like the
+// timer's never return), except for spurious interrupts, which must
+// not be acknowledged.
+bool
+irq_dispatch(struct Trapframe *tf)
+{
+	int irq = tf->tf_trapno - IRQ_OFFSET;
+
+	if (irq < 0 || irq >= MAX_IRQS || !irq_handlers[irq])
+		return 0;
+	TRACE(TRACE_IRQ, irq, tf->tf_eip, 0);
+	if (irq != IRQ_SPURIOUS) {
+		lapic_eoi();
+		pic_eoi(irq);
+	}
+	irq_handlers[irq](tf);
+	return 1;
+}
+
+// Wake the owner of 'irq' if the interrupt is pending and the owner is
+// blocked waiting for it or for an IPC.
+static void
+irq_env_deliver(int irq)
+{
+	struct Env *e;
+
+	if (!irq_envs[irq].ie_pending
+	    || envid2env(irq_envs[irq].ie_owner, &e, 0) < 0)
+		return;
+	if (irq_envs[irq].ie_waiting)
+		irq_envs[irq].ie_waiting = 0;
+	else if (e->env_ipc_recving) {
+		e->env_ipc_recving = 0;
+		e->env_ipc_from = 0;
+		e->env_ipc_value = irq;
+		e->env_ipc_perm = 0;
+		e->env_tf.tf_regs.reg_eax = 0;
+	} else
+		return;
+	irq_envs[irq].ie_pending = 0;
+	e->env_status = ENV_RUNNABLE;
+}
+
+static void
+irq_env_unmask(int irq)
+{
+	if (irq_mask_8259A & (1 << irq))
+		irq_setmask_quiet(irq_mask_8259A & ~(1 << irq));
+}
+
+static void
+irq_env_handler(struct Trapframe *tf)
+{
+	int irq = tf->tf_trapno - IRQ_OFFSET;
+
+	irq_setmask_quiet(irq_mask_8259A | (1 << irq));
+	irq_envs[irq].ie_pending = 1;
+	irq_env_deliver(irq);
+}
+
+// Deliver hardware IRQ 'irq' to environment 'e' from now on, and
+// unmask it.  IRQs the kernel handles itself cannot be taken over.
+// Returns 0 on success, -E_INVAL if irq is out of range or in use.
+int
+irq_attach(int irq, struct Env *e)
+{
+	if (irq < 0 || irq >= MAX_IRQS || irq == IRQ_SLAVE
+	    || (irq_handlers[irq] && irq_handlers[irq] != irq_env_handler))
+		return -E_INVAL;
+	irq_envs[irq].ie_owner = e->env_id;
+	irq_envs[irq].ie_pending = 0;
+	irq_envs[irq].ie_waiting = 0;
+	irq_register(irq, irq_env_handler);
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	return 0;
+}
+
+// Consume a pending 'irq' for its owner 'e'.  Returns 0 if there was
+// one, 1 if 'e' must block until it arrives (the caller marks it not
+// runnable), -E_INVAL if e does not own irq.
+int
+irq_wait(int irq, struct Env *e)
+{
+	if (irq < 0 || irq >= MAX_IRQS || irq_envs[irq].ie_owner != e->env_id)
+		return -E_INVAL;
+	irq_env_unmask(irq);
+	if (irq_envs[irq].ie_pending) {
+		irq_envs[irq].ie_pending = 0;
+		return 0;
+	}
+	irq_envs[irq].ie_waiting = 1;
+	return 1;
+}
+
+// Unmask the IRQs owned by 'e' and consume any pending one, for
+// sys_ipc_recv.
+// Returns the IRQ number, or -1 if none is pending.
+int
+irq_take(struct Env *e)
+{
+	int irq;
+
+	for (irq = 0; irq < MAX_IRQS; irq++) {
+		if (irq_envs[irq].ie_owner != e->env_id)
+			continue;
+		irq_env_unmask(irq);
+		if (irq_envs[irq].ie_pending) {
+			irq_envs[irq].ie_pending = 0;
+			return irq;
+		}
+	}
+	return -1;
+}
+
+// Stop delivering IRQs to 'e', which is being freed, and mask them.
+void
+irq_detach(struct Env *e)
+{
+	int irq;
+
+	for (irq = 0; irq < MAX_IRQS; irq++) {
+		if (irq_envs[irq].ie_owner != e->env_id)
+			continue;
+		irq_envs[irq].ie_owner = 0;
+		irq_envs[irq].ie_pending = 0;
+		irq_envs[irq].ie_waiting = 0;
+		irq_handlers[irq] = NULL;
+		irq_setmask_quiet(irq_mask_8259A | (1 << irq));
+	}
+}
+
+// Is any environment blocked waiting for an interrupt?
+bool
+irq_env_waiting(void)
+{
+	int irq;
+
+	for (irq = 0; irq < MAX_IRQS; irq++)
+		if (irq_envs[irq].ie_waiting)
+			return 1;
+	return 0;
+}
+
+// Queue fn(arg) to run on this CPU on its way out of the kernel.
+// If the queue is full, run it right away instead.
+void
+irq_defer(void (*fn)(void *), void *arg)
+{
+	int i = cpunum();
+
+	if (workq[i].wpos - workq[i].rpos == NDEFERRED) {
+		fn(arg);
+		return;
+	}
+	workq[i].q[workq[i].wpos % NDEFERRED].dw_fn = fn;
+	workq[i].q[workq[i].wpos % NDEFERRED].dw_arg = arg;
+	workq[i].wpos++;
+}
+
+static void
+run_queue(int i)
+{
+	struct DeferredWork *w;
+
+	// Work items may queue more work; keep going until empty.
+	while (workq[i].rpos != workq[i].wpos) {
+		w = &workq[i].q[workq[i].rpos++ % NDEFERRED];
+		w->dw_fn(w->dw_arg);
+	}
+}
+
+// Drain this CPU's deferred work.  Called on every exit to user mode.
+void
+irq_run_deferred(void)
+{
+	run_queue(cpunum());
+}
+
+// Drain every CPU's deferred work.  Called by CPUs about to go idle.
+void
+irq_run_deferred_all(void)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		run_queue(i);
+}
@@ -0,0 +1,35 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IRQ_H
+#define JOS_KERN_IRQ_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/trap.h>
+
+// Interrupt handlers ("top halves") run with interrupts disabled and
+// the big kernel lock held, so they should do the minimum needed to
+// quiet the device and push anything slower onto the deferred-work
+// queue with irq_defer().
+typedef void (*irq_handler_t)(struct Trapframe *tf);
+
+// Maximum number of pending deferred-work items per CPU
+#define NDEFERRED	32
+
+int	irq_register(int irq, irq_handler_t handler);
+bool	irq_dispatch(struct Trapframe *tf);
+
+struct Env;
+int	irq_attach(int irq, struct Env *e);
+int	irq_wait(int irq, struct Env *e);
+int	irq_take(struct Env *e);
+void	irq_detach(struct Env *e);
+bool	irq_env_waiting(void);
+
+void	irq_defer(void (*fn)(void *), void *arg);
+void	irq_run_deferred(void);
+void	irq_run_deferred_all(void);
+
+#endif	// !JOS_KERN_IRQ_H
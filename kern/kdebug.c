@@ -112,6 +112,18 @@ stab_binsearch(const struct Stab *stabs, int *region_left, int *region_right,
 //
 int
 debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
+{
+	return debuginfo_env_eip(curenv, addr, info);
+}
+
+// debuginfo_env_eip(e, addr, info)
+//
+//	Like debuginfo_eip, but user addresses are looked up in the stabs
+//	of environment 'e', whose address space must be the one loaded.
+//	Fails for user addresses if 'e' is NULL.
+//
+int
+debuginfo_env_eip(struct Env *e, uintptr_t addr, struct Eipdebuginfo *info)
 {
 	const struct Stab *stabs, *stab_end;
 	const char *stabstr, *stabstr_end;
@@ -142,6 +154,8 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 		// Make sure this memory is valid.
 		// Return -1 if it is not.  Hint: Call user_mem_check.
 		// LAB 3: Your code here.
+		if (!e || user_mem_check(e, usd, sizeof(*usd), PTE_U) < 0)
+			return -1;
 
 		stabs = usd->stabs;
 		stab_end = usd->stab_end;
@@ -150,6 +164,10 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 
 		// Make sure the STABS and string table memory is valid.
 		// LAB 3: Your code here.
+		if (stab_end < stabs ||
+		    user_mem_check(e, stabs, (stab_end - stabs) * sizeof(*stabs), PTE_U) < 0 ||
+		    user_mem_check(e, stabstr, stabstr_end - stabstr, PTE_U) < 0)
+			return -1;
 	}
 
 	// String table validity checks
@@ -0,0 +1,124 @@
+// In-memory kernel log.
+// Everything cprintf prints is also kept here, a line per record,
+// so that it can be read back later with sys_klog_read.
+
+#include <inc/types.h>
+#include <inc/x86.h>
+
+#include <kern/klog.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+
+// Records below wpos are complete.  The record at wpos holds the
+// line being printed, which overwrites the oldest line.
+static struct {
+	struct KlogRecord rec[KLOG_NRECORDS];
+	uint32_t wpos;
+	bool open;		// rec[wpos] has been started
+	bool full;		// The last record ended because it filled up
+} klog;
+
+// Environments blocked in sys_klog_wait, in slot ENVX(envid), 0 if
+// not waiting.
+static envid_t klog_waiters[NENV];
+static int klog_nwaiters;
+
+static void
+klog_commit(void)
+{
+	struct Env *e;
+	int i;
+
+	klog.wpos++;
+	klog.open = 0;
+
+	for (i = 0; i < NENV && klog_nwaiters > 0; i++) {
+		if (klog_waiters[i] == 0)
+			continue;
+		if (envid2env(klog_waiters[i], &e, 0) == 0
+		    && e->env_status == ENV_NOT_RUNNABLE)
+			e->env_status = ENV_RUNNABLE;
+		klog_waiters[i] = 0;
+		klog_nwaiters--;
+	}
+}
+
+// Append c to the log.  Called for every character cprintf prints.
+void
+klog_putc(int c)
+{
+	struct KlogRecord *kr = &klog.rec[klog.wpos % KLOG_NRECORDS];
+
+	// A line of exactly KLOG_LINELEN characters is already committed
+	// when its newline comes; don't add an empty record for it.
+	if (c == '\n' && klog.full) {
+		klog.full = 0;
+		return;
+	}
+	klog.full = 0;
+
+	if (!klog.open) {
+		kr->kr_tsc = read_tsc();
+		kr->kr_seq = klog.wpos;
+		kr->kr_cpu = cpunum();
+		kr->kr_len = 0;
+		klog.open = 1;
+	}
+	if (c == '\n') {
+		klog_commit();
+		return;
+	}
+	kr->kr_text[kr->kr_len++] = c;
+	if (kr->kr_len == KLOG_LINELEN) {
+		klog_commit();
+		klog.full = 1;
+	}
+}
+
+// Copy up to n complete records, starting with sequence number seq,
+// into buf.  If seq has already been overwritten, start with the
+// oldest record still kept; the caller can tell from kr_seq.
+// Returns the number of records copied.
+int
+klog_read(uint32_t seq, struct KlogRecord *buf, size_t n)
+{
+	uint32_t wpos = klog.wpos, i;
+
+	if (wpos - seq > wpos)		// seq is in the future
+		return 0;
+	// The slot at wpos is being reused for the current line.
+	if (wpos - seq > KLOG_NRECORDS - 1)
+		seq = wpos - (KLOG_NRECORDS - 1);
+	for (i = 0; i < n && seq + i != wpos; i++)
+		buf[i] = klog.rec[(seq + i) % KLOG_NRECORDS];
+	return i;
+}
+
+// Make env 'envid' runnable again once the record with sequence
+// number seq is complete.  Returns 0 if it already is, 1 if 'envid'
+// must block (the caller marks it not runnable).
+int
+klog_wait(envid_t envid, uint32_t seq)
+{
+	uint32_t wpos = klog.wpos;
+
+	if (wpos != seq && wpos - seq <= wpos)
+		return 0;
+	if (klog_waiters[ENVX(envid)] != envid) {
+		if (klog_waiters[ENVX(envid)] == 0)
+			klog_nwaiters++;
+		klog_waiters[ENVX(envid)] = envid;
+	}
+	return 1;
+}
+
+// Forget env 'envid' if it is waiting for the log.  Called when it is
+// freed.
+void
+klog_unwait(envid_t envid)
+{
+	if (klog_waiters[ENVX(envid)] != envid)
+		return;
+	klog_waiters[ENVX(envid)] = 0;
+	klog_nwaiters--;
+}
@@ -0,0 +1,18 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KLOG_H
+#define JOS_KERN_KLOG_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+#include <inc/klog.h>
+
+void klog_putc(int c);
+int klog_read(uint32_t seq, struct KlogRecord *buf, size_t n);
+int klog_wait(envid_t envid, uint32_t seq);
+void klog_unwait(envid_t envid);
+
+#endif	// !JOS_KERN_KLOG_H
@@ -45,6 +45,8 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+static uint32_t tsc_per_us;  // TSC ticks per microsecond; see tsc_calibrate
+
 static void
 lapicw(int index, int value)
 {
@@ -60,7 +62,10 @@ lapic_init(void)
 
 	// lapicaddr is the physical address of the LAPIC's 4K MMIO
 	// region.  Map it in to virtual memory so we can access it.
-	lapic = mmio_map_region(lapicaddr, 4096);
+	// Every LAPIC appears at the same address, so the BSP maps it
+	// once for all CPUs, which may then initialize concurrently.
+	if (!lapic)
+		lapic = mmio_map_region(lapicaddr, 4096);
 
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
@@ -127,19 +132,53 @@ lapic_eoi(void)
 		lapicw(EOI, 0);
 }
 
+#define IO_TIMER2   0x42         // 8253 timer channel 2
+#define IO_TIMERCTL 0x43         // 8253 mode control
+#define IO_PORTB    0x61         // Timer 2 gate (bit 0) and output (bit 5)
+#define TIMER_FREQ  1193182      // 8253 input clock, in Hz
+
+// Count TSC ticks over 10ms of 8253 timer channel 2.
+static void
+tsc_calibrate(void)
+{
+	uint32_t latch = TIMER_FREQ / 100;
+	uint64_t t0;
+	int i;
+
+	// Gate channel 2 on with the speaker off, then count down once.
+	outb(IO_PORTB, (inb(IO_PORTB) & ~0x02) | 0x01);
+	outb(IO_TIMERCTL, 0xB0);     // channel 2, lo/hi byte, mode 0
+	outb(IO_TIMER2, latch & 0xFF);
+	outb(IO_TIMER2, latch >> 8);
+
+	t0 = read_tsc();
+	for (i = 0; !(inb(IO_PORTB) & 0x20) && i < 10000000; i++)
+		;
+	tsc_per_us = (uint32_t) (read_tsc() - t0) / 10000;
+	if (tsc_per_us == 0)
+		tsc_per_us = 1;
+}
+
 // Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
 static void
 microdelay(int us)
 {
+	uint64_t end;
+
+	if (!tsc_per_us)
+		tsc_calibrate();
+	end = read_tsc() + (uint64_t) us * tsc_per_us;
+	while (read_tsc() < end)
+		;
 }
 
 #define IO_RTC  0x70
 
-// Start additional processor running entry code at addr.
-// See Appendix B of MultiProcessor Specification.
+// Start every other processor running entry code at addr.
+// See Appendix B of MultiProcessor Specification.  The INIT and
+// STARTUP IPIs are broadcast, so all APs boot at the same time.
 void
-lapic_startap(uint8_t apicid, uint32_t addr)
+lapic_startaps(uint32_t addr)
 {
 	int i;
 	uint16_t *wrv;
@@ -154,12 +193,12 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	wrv[1] = addr >> 4;
 
 	// "Universal startup algorithm."
-	// Send INIT (level-triggered) interrupt to reset other CPU.
-	lapicw(ICRHI, apicid << 24);
-	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	// Send INIT (level-triggered) interrupt to reset the other CPUs.
+	lapicw(ICRHI, 0);
+	lapicw(ICRLO, OTHERS | INIT | LEVEL | ASSERT);
 	microdelay(200);
-	lapicw(ICRLO, INIT | LEVEL);
-	microdelay(100);    // should be 10ms, but too slow in Bochs!
+	lapicw(ICRLO, BCAST | INIT | LEVEL);
+	microdelay(10000);
 
 	// Send startup IPI (twice!) to enter code.
 	// Regular hardware is supposed to only accept a STARTUP
@@ -167,8 +206,7 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	// should be ignored, but it is part of the official Intel algorithm.
 	// Bochs complains about the second one.  Too bad for Bochs.
 	for (i = 0; i < 2; i++) {
-		lapicw(ICRHI, apicid << 24);
-		lapicw(ICRLO, STARTUP | (addr >> 12));
+		lapicw(ICRLO, OTHERS | STARTUP | (addr >> 12));
 		microdelay(200);
 	}
 }
@@ -12,6 +12,10 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/ioapic.h>
+#include <kern/prof.h>
+#include <kern/trace.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -19,6 +23,9 @@ int mon_color(int argc, char **argv, struct Trapframe *tf);
 int mon_dumpvm(int argc, char **argv, struct Trapframe *tf);
 int mon_setperm(int argc, char **argv, struct Trapframe *tf);
 int mon_showmappings(int argc, char **argv, struct Trapframe *tf);
+int mon_irqaffinity(int argc, char **argv, struct Trapframe *tf);
+int mon_profile(int argc, char **argv, struct Trapframe *tf);
+int mon_trace(int argc, char **argv, struct Trapframe *tf);
 
 struct Command {
     const char *name;
@@ -36,6 +43,9 @@ static struct Command commands[] = {
     { "showmappings", "Display physical page mappings and permissions for a range of virtual addresses", mon_showmappings },
     { "setperm", "Set or clear permission bits of a mapping", mon_setperm },
     { "dumpvm", "Dump memory contents of a virtual address range", mon_dumpvm },
+    { "irqaffinity", "Show IRQ routing, pin an IRQ to a CPU, or balance IRQs", mon_irqaffinity },
+    { "profile", "Start, stop, reset or show the sampling profiler", mon_profile },
+    { "trace", "Enable or disable tracepoints, or show recent trace events", mon_trace },
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -356,6 +366,144 @@ mon_dumpvm(int argc, char **argv, struct Trapframe *tf)
     return 0;
 }
 
+int
+mon_irqaffinity(int argc, char **argv, struct Trapframe *tf)
+{
+    if (!ioapic_inuse) {
+        cprintf("No I/O APIC; all IRQs go to CPU %d through the 8259A\n",
+            bootcpu->cpu_id);
+        return 0;
+    }
+
+    // Spread enabled IRQs over the running CPUs
+    if (argc == 2 && strcmp(argv[1], "balance") == 0) {
+        ioapic_balance();
+        argc = 1;
+    }
+
+    // Pin one IRQ to one CPU
+    if (argc == 3) {
+        char *endptr;
+        int irq = strtol(argv[1], &endptr, 0);
+        if (*endptr != '\0') {
+            cprintf("Invalid IRQ\n");
+            return 0;
+        }
+        int cpu = strtol(argv[2], &endptr, 0);
+        if (*endptr != '\0') {
+            cprintf("Invalid CPU\n");
+            return 0;
+        }
+        if (ioapic_set_affinity(irq, cpu) < 0) {
+            cprintf("Cannot route IRQ %d to CPU %d\n", irq, cpu);
+            return 0;
+        }
+        argc = 1;
+    }
+
+    if (argc != 1) {
+        cprintf("Usage: irqaffinity [balance | <irq> <cpu>]\n");
+        return 0;
+    }
+
+    // Display the routing table
+    cprintf("IRQ  PIN  CPU\n");
+    for (int irq = 0; irq < MAX_IRQS; irq++) {
+        if (irq == IRQ_SLAVE)
+            continue;
+        cprintf("%3d  %3d  %3d%s\n", irq, irq_routes[irq].ir_pin,
+            irq_routes[irq].ir_cpu,
+            (irq_mask_8259A & (1 << irq)) ? "  (masked)" : "");
+    }
+    return 0;
+}
+
+int
+mon_profile(int argc, char **argv, struct Trapframe *tf)
+{
+    // Default to a report of the 20 hottest functions
+    if (argc == 1 || strcmp(argv[1], "show") == 0) {
+        int ntop = 20;
+        if (argc == 3) {
+            char *endptr;
+            ntop = strtol(argv[2], &endptr, 0);
+            if (*endptr != '\0' || ntop <= 0) {
+                cprintf("Invalid count\n");
+                return 0;
+            }
+        }
+        prof_report(ntop);
+    } else if (argc == 2 && strcmp(argv[1], "start") == 0) {
+        prof_start();
+    } else if (argc == 2 && strcmp(argv[1], "stop") == 0) {
+        prof_stop();
+    } else if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        prof_reset();
+    } else {
+        cprintf("Usage: profile [start | stop | reset | show [count]]\n");
+    }
+    return 0;
+}
+
+int
+mon_trace(int argc, char **argv, struct Trapframe *tf)
+{
+    // Turn events on or off by name, or all of them at once
+    if (argc >= 3 && (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0)) {
+        uint32_t mask = 0;
+        for (int i = 2; i < argc; i++) {
+            int type;
+            if (strcmp(argv[i], "all") == 0) {
+                mask |= (1 << NTRACE) - 1;
+                continue;
+            }
+            for (type = 0; type < NTRACE; type++)
+                if (strcmp(argv[i], trace_names[type]) == 0)
+                    break;
+            if (type == NTRACE) {
+                cprintf("Unknown event %s\n", argv[i]);
+                return 0;
+            }
+            mask |= 1 << type;
+        }
+        if (argv[1][1] == 'n')
+            trace_mask |= mask;
+        else
+            trace_mask &= ~mask;
+        argc = 1;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        trace_reset();
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "show") == 0) {
+        int n = 20;
+        if (argc == 3) {
+            char *endptr;
+            n = strtol(argv[2], &endptr, 0);
+            if (*endptr != '\0' || n <= 0) {
+                cprintf("Invalid count\n");
+                return 0;
+            }
+        }
+        trace_dump(n);
+        return 0;
+    }
+
+    if (argc != 1) {
+        cprintf("Usage: trace [on <event>... | off <event>... | reset | show [count]]\n");
+        return 0;
+    }
+
+    // List the events and whether each is enabled
+    for (int type = 0; type < NTRACE; type++)
+        cprintf("%-12s %s\n", trace_names[type],
+            (trace_mask & (1 << type)) ? "on" : "off");
+    return 0;
+}
+
 
 void
 monitor(struct Trapframe *tf)
@@ -9,6 +9,7 @@
 #include <inc/env.h>
 #include <kern/cpu.h>
 #include <kern/pmap.h>
+#include <kern/ioapic.h>
 
 struct CpuInfo cpus[NCPU];
 struct CpuInfo *bootcpu;
@@ -62,6 +63,36 @@ struct mpproc {         // processor table entry [MP 4.3.1]
 // mpproc flags
 #define MPPROC_BOOT 0x02                // This mpproc is the bootstrap processor
 
+struct mpbus {          // bus table entry [MP 4.3.2]
+	uint8_t type;                   // entry type (1)
+	uint8_t busid;                  // bus id
+	uint8_t bustype[6];             // bus type string, e.g. "ISA   "
+} __attribute__((__packed__));
+
+struct mpioapic {       // I/O APIC table entry [MP 4.3.3]
+	uint8_t type;                   // entry type (2)
+	uint8_t apicno;                 // I/O APIC id
+	uint8_t version;                // I/O APIC version
+	uint8_t flags;                  // I/O APIC flags
+	physaddr_t addr;                // I/O APIC address
+} __attribute__((__packed__));
+
+// mpioapic flags
+#define MPIOAPIC_EN 0x01                // This I/O APIC is usable
+
+struct mpiointr {       // I/O interrupt assignment entry [MP 4.3.4]
+	uint8_t type;                   // entry type (3)
+	uint8_t intrtype;               // interrupt type
+	uint16_t flags;                 // polarity and trigger mode
+	uint8_t busid;                  // source bus id
+	uint8_t busirq;                 // source bus irq
+	uint8_t apicno;                 // destination I/O APIC id
+	uint8_t intin;                  // destination I/O APIC pin
+} __attribute__((__packed__));
+
+// mpiointr interrupt types
+#define MPINTR_INT 0x00                 // Vectored interrupt
+
 // Table entry types
 #define MPPROC    0x00  // One per processor
 #define MPBUS     0x01  // One per bus
@@ -168,6 +199,10 @@ mp_init(void)
 	struct mp *mp;
 	struct mpconf *conf;
 	struct mpproc *proc;
+	struct mpbus *bus;
+	struct mpioapic *ioa;
+	struct mpiointr *intr;
+	uint32_t isabuses = 0;
 	uint8_t *p;
 	unsigned int i;
 
@@ -193,8 +228,32 @@ mp_init(void)
 			p += sizeof(struct mpproc);
 			continue;
 		case MPBUS:
+			bus = (struct mpbus *)p;
+			if (bus->busid < 32 && memcmp(bus->bustype, "ISA", 3) == 0)
+				isabuses |= 1 << bus->busid;
+			p += 8;
+			continue;
 		case MPIOAPIC:
+			// Only the first usable I/O APIC is driven.
+			ioa = (struct mpioapic *)p;
+			if ((ioa->flags & MPIOAPIC_EN) && !ioapicaddr) {
+				ioapicid = ioa->apicno;
+				ioapicaddr = ioa->addr;
+			}
+			p += 8;
+			continue;
 		case MPIOINTR:
+			// Record where each ISA IRQ enters the I/O APIC.
+			intr = (struct mpiointr *)p;
+			if (intr->intrtype == MPINTR_INT && intr->busid < 32 &&
+			    (isabuses & (1 << intr->busid)) &&
+			    intr->busirq < MAX_IRQS && intr->apicno == ioapicid) {
+				irq_routes[intr->busirq].ir_mp = 1;
+				irq_routes[intr->busirq].ir_pin = intr->intin;
+				irq_routes[intr->busirq].ir_flags = intr->flags;
+			}
+			p += 8;
+			continue;
 		case MPLINTR:
 			p += 8;
 			continue;
@@ -210,6 +269,7 @@ mp_init(void)
 		// Didn't like what we found; fall back to no MP.
 		ncpu = 1;
 		lapicaddr = 0;
+		ioapicaddr = 0;
 		cprintf("SMP: configuration not found, SMP disabled\n");
 		return;
 	}
@@ -4,6 +4,7 @@
 #include <inc/trap.h>
 
 #include <kern/picirq.h>
+#include <kern/ioapic.h>
 
 
 // Current IRQ mask.
@@ -68,15 +69,39 @@ pic_init(void)
 		irq_setmask_8259A(irq_mask_8259A);
 }
 
+// Like irq_setmask_8259A, but without the report, for masks that
+// change with every interrupt.
+void
+irq_setmask_quiet(uint16_t mask)
+{
+	irq_mask_8259A = mask;
+	if (!didinit)
+		return;
+	if (ioapic_inuse)
+		ioapic_setmask();
+	else {
+		outb(IO_PIC1+1, (char)mask);
+		outb(IO_PIC2+1, (char)(mask >> 8));
+	}
+}
+
+// Acknowledge IRQ 'irq' at the 8259A.  The master is in automatic
+// EOI mode, but the slave is not: until it gets an EOI it delivers
+// nothing more.  Nothing to do when the I/O APIC delivers IRQs.
+void
+pic_eoi(int irq)
+{
+	if (didinit && !ioapic_inuse && irq >= 8)
+		outb(IO_PIC2, 0x20);		// OCW2: non-specific EOI
+}
+
 void
 irq_setmask_8259A(uint16_t mask)
 {
 	int i;
-	irq_mask_8259A = mask;
+	irq_setmask_quiet(mask);
 	if (!didinit)
 		return;
-	outb(IO_PIC1+1, (char)mask);
-	outb(IO_PIC2+1, (char)(mask >> 8));
 	cprintf("enabled interrupts:");
 	for (i = 0; i < 16; i++)
 		if (~mask & (1<<i))
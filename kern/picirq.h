@@ -22,7 +22,9 @@
 
 extern uint16_t irq_mask_8259A;
 void pic_init(void);
+void pic_eoi(int irq);
 void irq_setmask_8259A(uint16_t mask);
+void irq_setmask_quiet(uint16_t mask);
 #endif // !__ASSEMBLER__
 
 #endif // !JOS_KERN_PICIRQ_H
@@ -11,6 +11,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/trace.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -349,10 +350,52 @@ page_alloc(int alloc_flags)
 		result->pp_link = NULL;
 		if (alloc_flags & ALLOC_ZERO)
 			memset(page2kva(result), 0, PGSIZE);
+		TRACE(TRACE_PAGE_ALLOC, page2pa(result), alloc_flags, 0);
 	}
 	return result;
 }
 
+// Allocate n physically contiguous pages, for devices that need them
+// (such as virtio rings), and return the first.  Like page_alloc, the
+// reference counts are left at 0.  This scans all of physical memory,
+// so it is meant for driver initialization only.
+//
+// Returns NULL if there is no run of n free pages.
+struct PageInfo *
+page_alloc_contig(int alloc_flags, size_t n)
+{
+	struct PageInfo *pp, **pprev, *tail = NULL;
+	size_t i, run = 0;
+
+	if (n == 0)
+		return NULL;
+
+	// Free pages have pp_link set, except the one at the tail
+	for (pp = page_free_list; pp; pp = pp->pp_link)
+		tail = pp;
+	for (i = 0; i < npages && run < n; i++)
+		if (pages[i].pp_ref == 0 && (pages[i].pp_link || &pages[i] == tail))
+			run++;
+		else
+			run = 0;
+	if (run < n)
+		return NULL;
+
+	pp = &pages[i - n];
+	for (pprev = &page_free_list; *pprev; )
+		if (*pprev >= pp && *pprev < pp + n)
+			*pprev = (*pprev)->pp_link;
+		else
+			pprev = &(*pprev)->pp_link;
+	for (i = 0; i < n; i++) {
+		pp[i].pp_link = NULL;
+		if (alloc_flags & ALLOC_ZERO)
+			memset(page2kva(&pp[i]), 0, PGSIZE);
+		TRACE(TRACE_PAGE_ALLOC, page2pa(&pp[i]), alloc_flags, 0);
+	}
+	return pp;
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -366,6 +409,7 @@ page_free(struct PageInfo *pp)
 	assert(pp->pp_ref == 0);
 	assert(pp->pp_link == NULL);
 
+	TRACE(TRACE_PAGE_FREE, page2pa(pp), 0, 0);
 	pp->pp_link = page_free_list;
 	page_free_list = pp;
 }
@@ -613,11 +657,23 @@ static uintptr_t user_mem_check_addr;
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
-	pte_t *pte = pgdir_walk(env->env_pgdir, va, 0);
-	if (pte == NULL || (*pte & (perm | PTE_P)) != (perm | PTE_P)) {
+	uintptr_t a = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	uintptr_t end = (uintptr_t) va + len;
+	pte_t *pte;
+
+	if (end < (uintptr_t) va) {
 		user_mem_check_addr = (uintptr_t) va;
 		return -E_FAULT;
 	}
+	do {
+		pte = pgdir_walk(env->env_pgdir, (void *) a, 0);
+		if (a >= ULIM || pte == NULL ||
+		    (*pte & (perm | PTE_P)) != (perm | PTE_P)) {
+			user_mem_check_addr = MAX(a, (uintptr_t) va);
+			return -E_FAULT;
+		}
+		a += PGSIZE;
+	} while (a < end);
 	return 0;
 }
 
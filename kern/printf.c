@@ -5,11 +5,14 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/klog.h>
+
 
 static void
 putch(int ch, int *cnt)
 {
 	cputchar(ch);
+	klog_putc(ch);
 	*cnt++;
 }
 
@@ -0,0 +1,168 @@
+// Sampling profiler driven by the local APIC timer.
+// Each timer interrupt records where the CPU was into that CPU's ring;
+// the monitor's 'profile' command turns the rings into a flat profile.
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/prof.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kdebug.h>
+
+// Maximum number of distinct functions a report can show
+#define PROF_NENTRIES	128
+#define PROF_NAMELEN	32
+
+bool prof_enabled;
+
+static struct {
+	struct ProfSample s[PROF_NSAMPLES];
+	uint32_t n;		// Samples ever taken; the ring keeps the latest
+} profbuf[NCPU];
+
+// Samples aggregated by function for prof_report
+struct ProfEntry {
+	bool pe_user;
+	envid_t pe_env;
+	uintptr_t pe_fn;		// Function start address
+	int pe_count;
+	char pe_name[PROF_NAMELEN];	// Copied; user stabs are not
+					// mapped once we switch back
+};
+
+static struct ProfEntry entries[PROF_NENTRIES];
+
+// Record one sample for the interrupt described by tf.
+// Called from the timer interrupt with the kernel lock held.
+void
+prof_sample(struct Trapframe *tf)
+{
+	int i = cpunum();
+	struct ProfSample *ps;
+
+	ps = &profbuf[i].s[profbuf[i].n++ % PROF_NSAMPLES];
+	ps->ps_user = (tf->tf_cs & 3) == 3;
+	ps->ps_eip = tf->tf_eip;
+	ps->ps_env = curenv ? curenv->env_id : 0;
+}
+
+void
+prof_start(void)
+{
+	prof_enabled = 1;
+}
+
+void
+prof_stop(void)
+{
+	prof_enabled = 0;
+}
+
+void
+prof_reset(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		profbuf[i].n = 0;
+}
+
+// Find the function containing ps->ps_eip and the entry counting it.
+// User addresses are looked up in the sampled env's own stabs, which
+// means briefly switching to its address space.
+static struct ProfEntry *
+prof_lookup(struct ProfSample *ps, int *nentries)
+{
+	struct Eipdebuginfo info;
+	struct Env *e = NULL;
+	uint32_t cr3 = rcr3();
+	const char *name = "<unknown>";
+	int i, namelen = 9;
+	uintptr_t fn = ps->ps_eip;
+
+	if (!ps->ps_user) {
+		if (debuginfo_eip(ps->ps_eip, &info) == 0) {
+			fn = info.eip_fn_addr;
+			name = info.eip_fn_name;
+			namelen = info.eip_fn_namelen;
+		}
+	} else if (envid2env(ps->ps_env, &e, 0) < 0) {
+		name = "<exited>";
+		namelen = 8;
+	} else {
+		lcr3(PADDR(e->env_pgdir));
+		if (debuginfo_env_eip(e, ps->ps_eip, &info) == 0) {
+			fn = info.eip_fn_addr;
+			name = info.eip_fn_name;
+			namelen = info.eip_fn_namelen;
+		}
+	}
+
+	for (i = 0; i < *nentries; i++)
+		if (entries[i].pe_fn == fn && entries[i].pe_user == ps->ps_user
+		    && entries[i].pe_env == (ps->ps_user ? ps->ps_env : 0))
+			break;
+	if (i == *nentries) {
+		if (i == PROF_NENTRIES) {
+			lcr3(cr3);
+			return NULL;
+		}
+		(*nentries)++;
+		entries[i].pe_user = ps->ps_user;
+		entries[i].pe_env = ps->ps_user ? ps->ps_env : 0;
+		entries[i].pe_fn = fn;
+		entries[i].pe_count = 0;
+		namelen = MIN(namelen, PROF_NAMELEN - 1);
+		memmove(entries[i].pe_name, name, namelen);
+		entries[i].pe_name[namelen] = '\0';
+	}
+	lcr3(cr3);
+	return &entries[i];
+}
+
+// Print the 'ntop' functions with the most samples across all CPUs.
+void
+prof_report(int ntop)
+{
+	struct ProfEntry *pe, tmp;
+	int c, i, j, n, nentries = 0, total = 0, dropped = 0;
+
+	for (c = 0; c < ncpu; c++) {
+		n = MIN(profbuf[c].n, PROF_NSAMPLES);
+		cprintf("CPU %d: %d samples\n", c, n);
+		for (i = 0; i < n; i++) {
+			if ((pe = prof_lookup(&profbuf[c].s[i], &nentries)))
+				pe->pe_count++;
+			else
+				dropped++;
+			total++;
+		}
+	}
+	if (total == 0) {
+		cprintf("No samples; use 'profile start' first\n");
+		return;
+	}
+
+	// Sort by descending sample count
+	for (i = 1; i < nentries; i++) {
+		tmp = entries[i];
+		for (j = i; j > 0 && entries[j - 1].pe_count < tmp.pe_count; j--)
+			entries[j] = entries[j - 1];
+		entries[j] = tmp;
+	}
+
+	cprintf("samples    %%  mode  env       address   function\n");
+	for (i = 0; i < nentries && i < ntop; i++) {
+		pe = &entries[i];
+		cprintf("%7d  %3d  %s  %08x  %08x  %s\n", pe->pe_count,
+			pe->pe_count * 100 / total, pe->pe_user ? "user" : "kern",
+			pe->pe_env, pe->pe_fn, pe->pe_name);
+	}
+	if (dropped)
+		cprintf("%d samples in functions beyond the first %d\n",
+			dropped, PROF_NENTRIES);
+}
@@ -0,0 +1,31 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PROF_H
+#define JOS_KERN_PROF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/trap.h>
+#include <inc/env.h>
+
+// Number of samples each CPU keeps; older samples are overwritten
+#define PROF_NSAMPLES	1024
+
+// One timer-interrupt sample
+struct ProfSample {
+	envid_t ps_env;		// Environment running on the CPU, 0 if none
+	uintptr_t ps_eip;	// Interrupted instruction
+	bool ps_user;		// Interrupted in user mode
+};
+
+extern bool prof_enabled;
+
+void prof_sample(struct Trapframe *tf);
+void prof_start(void);
+void prof_stop(void);
+void prof_reset(void);
+void prof_report(int ntop);
+
+#endif	// !JOS_KERN_PROF_H
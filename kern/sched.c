@@ -4,6 +4,9 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/irq.h>
+#include <kern/trace.h>
+#include <kern/console.h>
 
 void sched_halt(void);
 
@@ -30,6 +33,7 @@ sched_yield(void)
 	// below to halt the cpu.
 
 	// LAB 4: Your code here.
+	TRACE(TRACE_SCHED_YIELD, 0, 0, 0);
 
     // Start from the current environment
 	int i, nexti = 0;
@@ -57,15 +61,21 @@ sched_halt(void)
 {
 	int i;
 
+	// Use the idle time to drain any CPU's deferred interrupt work.
+	irq_run_deferred_all();
+
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
+	// Envs waiting for console input will run again once the user
+	// types, and envs waiting for a device interrupt once it comes,
+	// so wait for that instead.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
 		     envs[i].env_status == ENV_DYING))
 			break;
 	}
-	if (i == NENV) {
+	if (i == NENV && !cons_waiting() && !irq_env_waiting()) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
@@ -75,6 +85,9 @@ sched_halt(void)
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
+	// env_run pointed esp0 at the last env's save area
+	thiscpu->cpu_ts.ts_esp0 = percpu_kstacktop(cpunum());
+
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
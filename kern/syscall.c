@@ -11,6 +11,9 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/trace.h>
+#include <kern/klog.h>
+#include <kern/irq.h>
 
 static envid_t
 sys_getenvid(void);
@@ -18,9 +21,13 @@ sys_getenvid(void);
 static void
 sys_cputs(const char *s, size_t len)
 {
+	size_t i;
+
 	user_mem_assert(curenv, s, len, PTE_U | PTE_P);	
 
-	cprintf("%.*s", len, s);
+	// Straight to the console; the kernel log is for kernel messages.
+	for (i = 0; i < len; i++)
+		cputchar(s[i]);
 }
 
 static int
@@ -29,6 +36,30 @@ sys_cgetc(void)
 	return cons_getc();
 }
 
+// Read up to 'n' characters of console input into 'buf', blocking
+// until at least one is available.
+//
+// Returns the number of characters read.  Returns 0 after the env has
+// been woken by new input; the caller should try again.
+static int
+sys_cons_read(char *buf, size_t n)
+{
+	int r;
+
+	user_mem_assert(curenv, buf, n, PTE_U | PTE_W | PTE_P);
+
+	if (n == 0)
+		return 0;
+	if ((r = cons_read(buf, n)) > 0)
+		return r;
+
+	cons_wait(curenv->env_id);
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+
+	return 0;
+}
 
 static envid_t
 sys_getenvid(void)
@@ -332,6 +363,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	pte_t *pte;
 	int ret;
 
+	TRACE(TRACE_IPC_SEND, envid, value, srcva);
 	if ((ret = envid2env(envid, &e, 0)) < 0)
 		return ret;
 
@@ -387,9 +419,20 @@ _update_ipc_fields:
 static int
 sys_ipc_recv(void *dstva)
 {
+	int irq;
+
+	TRACE(TRACE_IPC_RECV, dstva, 0, 0);
 	if (dstva < (void *) UTOP && PGOFF(dstva) != 0)
 		return -E_INVAL;
 
+	// A pending device interrupt counts as a message from envid 0
+	if ((irq = irq_take(curenv)) >= 0) {
+		curenv->env_ipc_from = 0;
+		curenv->env_ipc_value = irq;
+		curenv->env_ipc_perm = 0;
+		return 0;
+	}
+
 	curenv->env_ipc_recving = 1;
 	curenv->env_ipc_dstva = dstva;
 	curenv->env_status = ENV_NOT_RUNNABLE;
@@ -399,16 +442,160 @@ sys_ipc_recv(void *dstva)
 	return 0;
 }
 
+// Copy up to 'n' trace events recorded on CPU 'cpu', starting with
+// sequence number 'seq', into 'buf'.  Only environments with I/O
+// privilege (the file system server) may read the trace.
+//
+// Returns the number of events copied, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller does not have I/O privilege.
+//	-E_INVAL if cpu is out of range.
+static int
+sys_trace_read(int cpu, uint32_t seq, struct TraceEvent *buf, size_t n)
+{
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0)
+		return -E_BAD_ENV;
+	n = MIN(n, TRACE_NEVENTS);
+	user_mem_assert(curenv, buf, n * sizeof(*buf), PTE_U | PTE_W | PTE_P);
+
+	return trace_read(cpu, seq, buf, n);
+}
+
+// Copy up to 'n' kernel log records, starting with sequence number
+// 'seq', into 'buf'.  Returns the number of records copied.
+static int
+sys_klog_read(uint32_t seq, struct KlogRecord *buf, size_t n)
+{
+	n = MIN(n, KLOG_NRECORDS);
+	user_mem_assert(curenv, buf, n * sizeof(*buf), PTE_U | PTE_W | PTE_P);
+
+	return klog_read(seq, buf, n);
+}
+
+// Block until the kernel log record with sequence number 'seq' is
+// complete.  Returns 0.
+static int
+sys_klog_wait(uint32_t seq)
+{
+	if (klog_wait(curenv->env_id, seq) == 0)
+		return 0;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+
+	return 0;
+}
+
+// Store the physical address that 'va' maps to in the caller's
+// address space in *pa, for programming DMA.  Only environments with
+// I/O privilege (the file system server) may ask.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller does not have I/O privilege.
+//	-E_INVAL if va >= UTOP or is not mapped.
+static int
+sys_page_paddr(void *va, physaddr_t *pa)
+{
+	struct PageInfo *pp;
+
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0)
+		return -E_BAD_ENV;
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL;
+	user_mem_assert(curenv, pa, sizeof(*pa), PTE_U | PTE_W | PTE_P);
+
+	if ((pp = page_lookup(curenv->env_pgdir, va, NULL)) == NULL)
+		return -E_INVAL;
+	*pa = page2pa(pp) + PGOFF(va);
+	return 0;
+}
+
+// Allocate npages physically contiguous pages and map them read/write
+// at [va, va + npages * PGSIZE) in the caller, which must have I/O
+// privilege.  For device rings that must be contiguous.  Pages already
+// mapped there are unmapped as a side effect.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller does not have I/O privilege.
+//	-E_INVAL if va is not page-aligned, npages is out of range,
+//		or the range is not below UTOP.
+//	-E_NO_MEM if there is no run of npages free pages, or no memory
+//		for page tables.
+static int
+sys_page_alloc_contig(void *va, size_t npages)
+{
+	struct PageInfo *pp;
+	size_t i, j;
+	int r;
+
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0)
+		return -E_BAD_ENV;
+	if (PGOFF(va) || npages == 0 || npages > 16
+	    || (uintptr_t) va >= UTOP || npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+
+	if ((pp = page_alloc_contig(ALLOC_ZERO, npages)) == NULL)
+		return -E_NO_MEM;
+	for (i = 0; i < npages; i++)
+		if ((r = page_insert(curenv->env_pgdir, &pp[i],
+				     (char *) va + i * PGSIZE,
+				     PTE_U | PTE_W | PTE_P)) < 0) {
+			// Free the pages not yet mapped; unmapping the
+			// others frees them
+			for (j = i; j < npages; j++)
+				page_free(&pp[j]);
+			while (i > 0)
+				page_remove(curenv->env_pgdir,
+					    (char *) va + --i * PGSIZE);
+			return r;
+		}
+	return 0;
+}
+
+// Have hardware interrupt 'irq' delivered to the caller, which must
+// have I/O privilege.  See kern/irq.c.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller does not have I/O privilege.
+//	-E_INVAL if irq is out of range or handled by the kernel.
+static int
+sys_irq_attach(int irq)
+{
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0)
+		return -E_BAD_ENV;
+	return irq_attach(irq, curenv);
+}
+
+// Block until interrupt 'irq', attached with sys_irq_attach, arrives.
+// Returns at once if one arrived since the last wait.
+//
+// Returns 0 on success, -E_INVAL if the caller does not own irq.
+static int
+sys_irq_wait(int irq)
+{
+	int r;
+
+	if ((r = irq_wait(irq, curenv)) <= 0)
+		return r;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+
+	return 0;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {	
+	TRACE(TRACE_SYSCALL, syscallno, a1, a2);
 	switch (syscallno) {
 	case SYS_cputs:
 		sys_cputs((char *) a1, a2);
 		return 0;
 	case SYS_cgetc:
 		return sys_cgetc();
+	case SYS_cons_read:
+		return sys_cons_read((char *) a1, a2);
 	case SYS_env_destroy:
 		return sys_env_destroy(a1);
 	case SYS_getenvid:
@@ -432,6 +619,20 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return sys_ipc_try_send(a1, a2, (void *) a3, a4);
 	case SYS_ipc_recv:
 		return sys_ipc_recv((void *) a1);
+	case SYS_trace_read:
+		return sys_trace_read(a1, a2, (struct TraceEvent *) a3, a4);
+	case SYS_klog_read:
+		return sys_klog_read(a1, (struct KlogRecord *) a2, a3);
+	case SYS_klog_wait:
+		return sys_klog_wait(a1);
+	case SYS_page_paddr:
+		return sys_page_paddr((void *) a1, (physaddr_t *) a2);
+	case SYS_page_alloc_contig:
+		return sys_page_alloc_contig((void *) a1, a2);
+	case SYS_irq_attach:
+		return sys_irq_attach(a1);
+	case SYS_irq_wait:
+		return sys_irq_wait(a1);
 	default:
 		return -E_NO_SYS;
 	}
@@ -0,0 +1,111 @@
+// Kernel tracepoints.
+// Each CPU appends the events it records to its own ring, so recording
+// never takes a lock; readers copy events out by sequence number.
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/error.h>
+#include <inc/x86.h>
+
+#include <kern/trace.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+
+uint32_t trace_mask;
+
+const char *const trace_names[NTRACE] = {
+	[TRACE_ENV_RUN]		= "env_run",
+	[TRACE_SCHED_YIELD]	= "sched_yield",
+	[TRACE_SYSCALL]		= "syscall",
+	[TRACE_PGFAULT]		= "pgfault",
+	[TRACE_PAGE_ALLOC]	= "page_alloc",
+	[TRACE_PAGE_FREE]	= "page_free",
+	[TRACE_IPC_SEND]	= "ipc_send",
+	[TRACE_IPC_RECV]	= "ipc_recv",
+	[TRACE_IRQ]		= "irq",
+};
+
+// Only CPU i writes tracebuf[i].  wpos is advanced after the event is
+// filled in, so events below wpos are always complete.
+static struct {
+	struct TraceEvent ev[TRACE_NEVENTS];
+	volatile uint32_t wpos;
+} tracebuf[NCPU];
+
+// Append an event to this CPU's ring.  Use the TRACE macro instead of
+// calling this directly so that disabled events cost nothing.
+void
+trace_record(int type, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+	int i = cpunum();
+	uint32_t seq = tracebuf[i].wpos;
+	struct TraceEvent *te = &tracebuf[i].ev[seq % TRACE_NEVENTS];
+
+	te->te_tsc = read_tsc();
+	te->te_seq = seq;
+	te->te_env = curenv ? curenv->env_id : 0;
+	te->te_cpu = i;
+	te->te_type = type;
+	te->te_arg[0] = a0;
+	te->te_arg[1] = a1;
+	te->te_arg[2] = a2;
+	asm volatile("" ::: "memory");
+	tracebuf[i].wpos = seq + 1;
+}
+
+void
+trace_reset(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		tracebuf[i].wpos = 0;
+}
+
+// Copy up to n events recorded on CPU 'cpu', starting with sequence
+// number 'seq', into buf.  If those events have already been
+// overwritten, start with the oldest event still in the ring; the
+// caller can tell from te_seq.
+//
+// Returns the number of events copied, or -E_INVAL if cpu is out
+// of range.
+int
+trace_read(int cpu, uint32_t seq, struct TraceEvent *buf, size_t n)
+{
+	uint32_t wpos, i;
+
+	if (cpu < 0 || cpu >= ncpu)
+		return -E_INVAL;
+
+	wpos = tracebuf[cpu].wpos;
+	if (wpos - seq > wpos)		// seq is in the future
+		return 0;
+	if (wpos - seq > TRACE_NEVENTS)
+		seq = wpos - TRACE_NEVENTS;
+	for (i = 0; i < n && seq + i != wpos; i++)
+		buf[i] = tracebuf[cpu].ev[(seq + i) % TRACE_NEVENTS];
+	return i;
+}
+
+// Print the last n events of every CPU, oldest first per CPU.
+void
+trace_dump(int n)
+{
+	struct TraceEvent te;
+	uint32_t seq, wpos;
+	int c;
+
+	for (c = 0; c < ncpu; c++) {
+		wpos = tracebuf[c].wpos;
+		seq = wpos - MIN(MIN(wpos, (uint32_t) n), TRACE_NEVENTS);
+		cprintf("CPU %d: %u events\n", c, wpos);
+		for (; seq != wpos; seq++) {
+			te = tracebuf[c].ev[seq % TRACE_NEVENTS];
+			cprintf("  %016llx %6u %08x %-11s %08x %08x %08x\n",
+				te.te_tsc, te.te_seq, te.te_env,
+				trace_names[te.te_type], te.te_arg[0],
+				te.te_arg[1], te.te_arg[2]);
+		}
+	}
+}
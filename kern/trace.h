@@ -0,0 +1,31 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TRACE_H
+#define JOS_KERN_TRACE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/trace.h>
+
+// Bit (1 << TRACE_x) is set if events of type TRACE_x are recorded
+extern uint32_t trace_mask;
+
+// Record an event if its type is enabled.  A disabled tracepoint costs
+// one load and one branch.
+#define TRACE(type, a0, a1, a2)						\
+	do {								\
+		if (trace_mask & (1 << (type)))				\
+			trace_record((type), (uint32_t) (a0),		\
+				     (uint32_t) (a1), (uint32_t) (a2));	\
+	} while (0)
+
+extern const char *const trace_names[NTRACE];
+
+void trace_record(int type, uint32_t a0, uint32_t a1, uint32_t a2);
+void trace_reset(void);
+int trace_read(int cpu, uint32_t seq, struct TraceEvent *buf, size_t n);
+void trace_dump(int n);
+
+#endif	// !JOS_KERN_TRACE_H
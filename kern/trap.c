@@ -13,6 +13,9 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/irq.h>
+#include <kern/prof.h>
+#include <kern/trace.h>
 
 static struct Taskstate ts;
 
@@ -67,6 +70,24 @@ static const char *trapname(int trapno)
 
 
 
+// Spurious interrupts are not acknowledged; just note them.
+static void
+spurious_intr(struct Trapframe *tf)
+{
+	cprintf("Spurious interrupt on irq 7. \n");
+	print_trapframe(tf);
+}
+
+// The local APIC timer drives preemption and the sampling profiler.
+static void
+timer_intr(struct Trapframe *tf)
+{
+	if (prof_enabled)
+		prof_sample(tf);
+	sched_yield(); // should never return
+	panic("sched_yield returns to timer_intr");
+}
+
 void
 trap_init(void)
 {
@@ -144,6 +165,12 @@ trap_init(void)
 
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, t_syscall, 3);
 
+	// _alltraps tests the saved %cs by offset
+	static_assert(offsetof(struct Trapframe, tf_cs) == TF_CS);
+
+	irq_register(IRQ_TIMER, timer_intr);
+	irq_register(IRQ_SPURIOUS, spurious_intr);
+
 	// Per-CPU setup 
 	trap_init_percpu();
 }
@@ -177,7 +204,7 @@ trap_init_percpu(void)
 	int i = cpunum();
 
 	// Setup a TSS so that we get the right stack
-	thiscpu->cpu_ts.ts_esp0 = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	thiscpu->cpu_ts.ts_esp0 = percpu_kstacktop(i);
 	thiscpu->cpu_ts.ts_ss0 = GD_KD;		
 
 	// Initialize the TSS slot of the gdt
@@ -265,26 +292,10 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
-	// Handle spurious interrupts
-	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SPURIOUS) {
-		cprintf("Spurious interrupt on irq 7. \n");
-		print_trapframe(tf);
+	// Handle hardware interrupts: timer, spurious, keyboard, serial
+	// and whatever else has registered with irq_register().
+	if (irq_dispatch(tf))
 		return;
-	}
-
-	// Handle clock interrupts
-	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
-		lapic_eoi();
-		sched_yield(); // should never return
-		panic("sched_yield returns to trap_dispatch");
-	}
-
-	// Handle keyboard and serial interrupts.
-	// LAB 5: Your code here.
-	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
-		kbd_intr();
-		return;
-	}
 
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
@@ -321,10 +332,9 @@ trap(struct Trapframe *tf)
 			sched_yield();
 		}
 
-		// Copy trap frame
-		curenv->env_tf = *tf;
-
-		tf = &curenv->env_tf;
+		// _alltraps built the trap frame in place, so there is
+		// nothing to copy.
+		assert(tf == &curenv->env_tf);
 	}
 
 	last_tf = tf;
@@ -343,6 +353,7 @@ page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
 	fault_va = rcr2();
+	TRACE(TRACE_PGFAULT, fault_va, tf->tf_eip, tf->tf_err);
 
 	// Handle kernel-mode page faults.
 	if ((tf->tf_cs & 0x3) == 0) 
@@ -78,19 +78,20 @@ opencons(void)
 static ssize_t
 devcons_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	int c;
+	int r;
 
 	if (n == 0)
 		return 0;
 
-	while ((c = sys_cgetc()) == 0)
-		sys_yield();
-	if (c < 0)
-		return c;
-	if (c == 0x04)	// ctl-d is eof
+	// The kernel puts us to sleep until there is input; 0 means
+	// we were woken and should read again.
+	while ((r = sys_cons_read(vbuf, n)) == 0)
+		/* do nothing */;
+	if (r < 0)
+		return r;
+	if (*(char*)vbuf == 0x04)	// ctl-d is eof
 		return 0;
-	*(char*)vbuf = c;
-	return 1;
+	return r;
 }
 
 static ssize_t
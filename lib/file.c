@@ -170,6 +170,27 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
+// Allocate disk space for 'len' bytes of file 'fdnum' starting at
+// 'offset', extending the file if necessary, so that later writes
+// to that range cannot run out of space and land contiguously.
+int
+fallocate(int fdnum, off_t offset, off_t len)
+{
+	int r;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	fsipcbuf.allocate.req_fileid = fd->fd_file.id;
+	fsipcbuf.allocate.req_offset = offset;
+	fsipcbuf.allocate.req_len = len;
+	return fsipc(FSREQ_ALLOCATE, NULL);
+}
+
 
 // Synchronize disk with buffer cache
 int
@@ -116,3 +116,51 @@ sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
+
+int
+sys_trace_read(int cpu, uint32_t seq, struct TraceEvent *buf, size_t n)
+{
+	return syscall(SYS_trace_read, 0, cpu, seq, (uint32_t) buf, n, 0);
+}
+
+int
+sys_klog_read(uint32_t seq, struct KlogRecord *buf, size_t n)
+{
+	return syscall(SYS_klog_read, 0, seq, (uint32_t) buf, n, 0, 0);
+}
+
+int
+sys_klog_wait(uint32_t seq)
+{
+	return syscall(SYS_klog_wait, 0, seq, 0, 0, 0, 0);
+}
+
+int
+sys_cons_read(void *buf, size_t n)
+{
+	return syscall(SYS_cons_read, 0, (uint32_t) buf, n, 0, 0, 0);
+}
+
+int
+sys_page_paddr(void *va, physaddr_t *pa)
+{
+	return syscall(SYS_page_paddr, 0, (uint32_t) va, (uint32_t) pa, 0, 0, 0);
+}
+
+int
+sys_irq_attach(int irq)
+{
+	return syscall(SYS_irq_attach, 1, irq, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(int irq)
+{
+	return syscall(SYS_irq_wait, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_page_alloc_contig(void *va, size_t npages)
+{
+	return syscall(SYS_page_alloc_contig, 1, (uint32_t) va, npages, 0, 0, 0);
+}
@@ -0,0 +1,63 @@
+// Print the kernel log.
+//
+//	dmesg [-f] [-o file]
+//
+// -f keeps waiting for new lines; -o writes the log to a file
+// instead of the console.
+
+#include <inc/lib.h>
+
+static struct KlogRecord recs[16];
+
+void
+usage(void)
+{
+	printf("usage: dmesg [-f] [-o file]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, n, fd = 1, follow = 0;
+	uint32_t seq = 0;
+	struct Argstate args;
+
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'f':
+			follow = 1;
+			break;
+		case 'o':
+			if (!argvalue(&args))
+				usage();
+			if ((fd = open(argvalue(&args), O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+				panic("open %s: %e", argvalue(&args), fd);
+			break;
+		default:
+			usage();
+		}
+	if (argc != 1)
+		usage();
+
+	while (1) {
+		n = sys_klog_read(seq, recs, ARRAY_SIZE(recs));
+		if (n < 0)
+			panic("sys_klog_read: %e", n);
+		if (n == 0) {
+			if (!follow)
+				break;
+			sys_klog_wait(seq);
+			continue;
+		}
+		if (recs[0].kr_seq != seq)
+			fprintf(fd, "[%u lines lost]\n", recs[0].kr_seq - seq);
+		for (i = 0; i < n; i++)
+			fprintf(fd, "[%016llx] %d: %.*s\n", recs[i].kr_tsc,
+				recs[i].kr_cpu, recs[i].kr_len, recs[i].kr_text);
+		seq = recs[n - 1].kr_seq + 1;
+	}
+	if (fd != 1)
+		close(fd);
+}